@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,10 +12,16 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// The cache starts with NBUF buffers and grows on misses, taking
+// each block's data from the buddy allocator, until it holds
+// 1/BCACHEFRAC of RAM. When kalloc() runs out of memory it calls
+// bshrink() to give the data of unused buffers back.
 
 
 #include "types.h"
 #include "param.h"
+#include "memlayout.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
@@ -23,69 +29,271 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
-  struct spinlock lock;
-  struct buf buf[NBUF];
+#define NBUCKET 13
+#define NRA     32   // most bufs breadahead() submits at once
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
+// Buffers are hashed by (dev, blockno) into buckets, each with
+// its own lock and its own list sorted by how recently its buffers
+// were used (head.next is most recent, head.prev is least).
+// A bucket's lock protects its list and the dev, blockno and
+// refcnt of the buffers on it.
+struct bucket {
+  struct spinlock lock;
   struct buf head;
+};
+
+struct {
+  struct bucket bucket[NBUCKET];
+  struct slabcache *cache;  // where struct bufs come from
+
+  struct spinlock lock;     // protects spare
+  struct buf *spare;        // bufs whose data was given back, via next
+
+  int nbuf;                 // bufs with data
+  int max;                  // limit on nbuf
+
+  // statistics
+  uint hits;
+  uint misses;
+  uint steals;   // buffers recycled from another bucket
+  uint shrunk;   // buffers given back to kalloc()
+  uint readaheads;
 } bcache;
 
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// Put b at the most recently used end of bucket bk.
+static void
+blink(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+// Allocate a buffer with room for a block, unless the cache
+// is at its limit or memory is short. Takes no bucket lock,
+// so it may call kalloc() without risking bshrink() deadlock.
+static struct buf*
+bnew(void)
+{
+  struct buf *b;
+
+  if(__sync_fetch_and_add(&bcache.nbuf, 1) >= bcache.max){
+    __sync_fetch_and_sub(&bcache.nbuf, 1);
+    return 0;
+  }
+
+  acquire(&bcache.lock);
+  if((b = bcache.spare) != 0)
+    bcache.spare = b->next;
+  release(&bcache.lock);
+  if(b == 0){
+    if((b = slaballoc(bcache.cache)) == 0)
+      goto bad;
+    initsleeplock(&b->lock, "buffer");
+  }
+
+  if((b->data = bd_malloc(BSIZE)) == 0){
+    acquire(&bcache.lock);
+    b->next = bcache.spare;
+    bcache.spare = b;
+    release(&bcache.lock);
+    goto bad;
+  }
+  b->refcnt = 0;
+  return b;
+
+ bad:
+  __sync_fetch_and_sub(&bcache.nbuf, 1);
+  return 0;
+}
+
 void
 binit(void)
 {
+  struct bucket *bk;
   struct buf *b;
 
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
   initlock(&bcache.lock, "bcache");
+  bcache.cache = slabcreate("buf", sizeof(struct buf), 0);
+  bcache.max = (PHYSTOP - KERNBASE) / BCACHEFRAC / BSIZE;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  // Start with NBUF buffers, spread over the buckets.
+  for(int i = 0; i < NBUF; i++){
+    if((b = bnew()) == 0)
+      panic("binit");
+    b->dev = -1;
+    blink(&bcache.bucket[i % NBUCKET], b);
+  }
+}
+
+// Return the cached buf for the block, or 0.
+// Caller must hold bk->lock.
+static struct buf*
+blookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
   }
+  return 0;
+}
+
+// Take the least recently used unused buffer off bk's list.
+// Caller must hold bk->lock.
+static struct buf*
+bvictim(struct bucket *bk)
+{
+  struct buf *b;
+
+  for(b = bk->head.prev; b != &bk->head; b = b->prev){
+    if(b->refcnt == 0){
+      bunlink(b);
+      return b;
+    }
+  }
+  return 0;
+}
+
+// Take an unused buffer from any bucket, starting after bk.
+// Caller must hold no bucket lock.
+static struct buf*
+bsteal(struct bucket *bk)
+{
+  struct bucket *other;
+  struct buf *b = 0;
+
+  for(int i = 1; i <= NBUCKET && b == 0; i++){
+    other = &bcache.bucket[(bk - bcache.bucket + i) % NBUCKET];
+    acquire(&other->lock);
+    b = bvictim(other);
+    release(&other->lock);
+  }
+  if(b)
+    __sync_fetch_and_add(&bcache.steals, 1);
+  return b;
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
-// In either case, return locked buffer.
+// In either case, return locked buffer. But if ifnew is set,
+// return 0 for a block that is already cached; then bget()
+// never sleeps, since no one else can know about a new buffer
+// before its lock is taken.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int ifnew)
 {
-  struct buf *b;
+  struct bucket *bk = &bcache.bucket[BHASH(dev, blockno)];
+  struct buf *b, *victim;
 
-  acquire(&bcache.lock);
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  if((b = blookup(bk, dev, blockno)) != 0){
+    if(ifnew){
+      release(&bk->lock);
+      return 0;
     }
+    __sync_fetch_and_add(&bcache.hits, 1);
+    goto found;
   }
+  __sync_fetch_and_add(&bcache.misses, 1);
+
+  // Not cached. Once the cache has reached its limit, recycle the
+  // least recently used unused buffer in this bucket.
+  if(bcache.nbuf >= bcache.max && (victim = bvictim(bk)) != 0)
+    goto install;
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+  // Otherwise grow the cache or, if that fails, steal from another
+  // bucket. Both happen without this bucket's lock, so search it
+  // again afterwards: another process may have cached the block.
+  release(&bk->lock);
+  if((victim = bnew()) == 0 && (victim = bsteal(bk)) == 0)
+    panic("bget: no buffers");
+  acquire(&bk->lock);
+  if((b = blookup(bk, dev, blockno)) != 0){
+    // keep the victim here, unused, for next time.
+    victim->dev = -1;
+    victim->valid = 0;
+    victim->refcnt = 0;
+    blink(bk, victim);
+    if(ifnew){
+      release(&bk->lock);
+      return 0;
+    }
+    goto found;
+  }
+
+ install:
+  b = victim;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  blink(bk, b);
+  acquiresleep(&b->lock);  // free, since refcnt was 0
+  release(&bk->lock);
+  return b;
+
+ found:
+  b->refcnt++;
+  release(&bk->lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Give the data of up to n unused buffers back to the buddy
+// allocator, least recently used first, keeping at least NBUF.
+// Called by kalloc() when memory runs out, so it may run with
+// any lock held except bucket locks, which no one holds while
+// allocating memory. Returns the number of buffers freed.
+int
+bshrink(int n)
+{
+  struct bucket *bk;
+  struct buf *b, *prev;
+  int freed = 0;
+
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET && freed < n; bk++){
+    acquire(&bk->lock);
+    for(b = bk->head.prev; b != &bk->head && freed < n; b = prev){
+      prev = b->prev;
+      if(b->refcnt != 0)
+        continue;
+      if(__sync_fetch_and_sub(&bcache.nbuf, 1) <= NBUF){
+        __sync_fetch_and_add(&bcache.nbuf, 1);
+        release(&bk->lock);
+        goto out;
+      }
+      bunlink(b);
+      bd_free(b->data);
+      b->data = 0;
+      acquire(&bcache.lock);
+      b->next = bcache.spare;
+      bcache.spare = b;
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      freed++;
     }
+    release(&bk->lock);
   }
-  panic("bget: no buffers");
+ out:
+  __sync_fetch_and_add(&bcache.shrunk, freed);
+  return freed;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,7 +302,7 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
     virtio_disk_rw(b, 0);
     b->valid = 1;
@@ -102,6 +310,18 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return a locked buf for the indicated block without reading
+// it, for a caller that is about to overwrite all of its data.
+struct buf*
+bclaim(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  b->valid = 1;
+  return b;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,8 +331,49 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Write the contents of the n bufs in bs to disk, all in flight
+// at once. All must be locked. Reorders bs.
+void
+bwritev(struct buf **bs, int n)
+{
+  struct buf *b;
+  int i, j;
+
+  // sort by block number, so that runs of adjacent blocks
+  // go to the disk as single requests.
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwritev");
+    b = bs[i];
+    for(j = i; j > 0 && bs[j-1]->blockno > b->blockno; j--)
+      bs[j] = bs[j-1];
+    bs[j] = b;
+  }
+  virtio_disk_start(bs, n, 1, 0);
+  for(int i = 0; i < n; i++)
+    virtio_disk_wait(bs[i]);
+}
+
+// Drop a reference to b, whose lock is not held, and move b to
+// the head of its bucket's most-recently-used list if unused.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  if (b->refcnt == 0) {
+    // no one is waiting for it.
+    bunlink(b);
+    blink(bk, b);
+  }
+  
+  release(&bk->lock);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Move to the head of its bucket's most-recently-used list.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +381,76 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bput(b);
+}
 
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+// Called from virtio_disk_intr() when a readahead finishes.
+// Releases the buffer on behalf of breadahead()'s caller.
+static void
+breadahead_done(struct buf *b)
+{
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
+}
+
+// Start reading the n blocks in blocknos into the cache without
+// waiting for them, skipping blocks that are cached already.
+// Blocks adjacent in blocknos and on disk are read with one request.
+// Readers that want a block before its read finishes wait for its
+// buffer lock in bget().
+void
+breadahead(uint dev, uint *blocknos, int n)
+{
+  struct buf *bs[NRA];
+  struct buf *b;
+  int nb = 0;
+
+  for(int i = 0; i < n; i++){
+    if((b = bget(dev, blocknos[i], 1)) == 0)
+      continue;
+    bs[nb++] = b;
+    if(nb == NRA){
+      __sync_fetch_and_add(&bcache.readaheads, nb);
+      virtio_disk_start(bs, nb, 0, breadahead_done);
+      nb = 0;
+    }
+  }
+  if(nb > 0){
+    __sync_fetch_and_add(&bcache.readaheads, nb);
+    virtio_disk_start(bs, nb, 0, breadahead_done);
   }
-  
-  release(&bcache.lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
+// Print buffer cache statistics. No locks, like statdump().
+void
+bstats(void)
+{
+  uint contended = 0;
 
+  for(int i = 0; i < NBUCKET; i++)
+    contended += bcache.bucket[i].lock.ncontend;
+  printf("bcache: %d/%d buffers, %d hits, %d misses, %d steals, %d shrunk, %d readaheads\n",
+         bcache.nbuf, bcache.max, bcache.hits, bcache.misses, bcache.steals,
+         bcache.shrunk, bcache.readaheads);
+  printf("bcache: %d buckets, %d contended bucket lock acquires\n",
+         NBUCKET, contended);
+}
@@ -14,7 +14,9 @@ static int nsizes;  // the number of entries in bd_sizes array
 #define MAXSIZE (nsizes - 1)  // Largest index in bd_sizes array
 #define BLK_SIZE(k) ((1L << (k)) * LEAF_SIZE)  // Size of block at size k
 #define HEAP_SIZE BLK_SIZE(MAXSIZE)
-#define NBLK(k) (1 << (MAXSIZE - k))  // Number of block at size k
+#define NBLK(k) (1L << (MAXSIZE - (k)))  // Number of block at size k
+#define PGK 7                 // size k of a PGSIZE block (PGSIZE / LEAF_SIZE == 1 << PGK)
+#define SUBPAGE 0xff          // bd_order entry for a page split below PGSIZE
 #define ROUNDUP(n, sz) \
   (((((n)-1) / (sz)) + 1) * (sz))  // Round up to the next multiple of sz
 
@@ -23,13 +25,13 @@ typedef struct list Bd_list;
 // The allocator has sz_info for each size k. Each sz_info has a free
 // list, an array alloc to keep track which blocks have been
 // allocated, and an split array to to keep track which blocks have
-// been split.  The arrays are of type char (which is 1 byte), but the
-// allocator uses 1 bit per block (thus, one char records the info of
-// 8 blocks).
+// been split.  The arrays are of type uint64 and the allocator uses
+// 1 bit per block, so one word records the info of 64 blocks and
+// scans and range updates go a word at a time.
 struct sz_info {
   Bd_list free;
-  char *alloc;
-  char *split;
+  uint64 *alloc;
+  uint64 *split;
 };
 typedef struct sz_info Sz_info;
 
@@ -37,47 +39,110 @@ static Sz_info *bd_sizes;
 static void *bd_base;  // start address of memory managed by the buddy allocator
 static struct spinlock lock;
 
+// The size k of each allocated block of at least PGSIZE, stored
+// at the index of the block's first page, so that bd_free() finds
+// it with one load. Pages holding smaller blocks are marked
+// SUBPAGE, and only those need a (bounded) search of the split
+// bitmaps.
+static uchar *bd_order;
+
+static uint64 bd_init_time;  // r_time() ticks bd_init() took
+
+#define BPW 64  // bits per bitmap word
+
 // Return 1 if bit at position index in array is set to 1
-int bit_isset(char *array, int index) {
-  char b = array[index / 8];
-  char m = (1 << (index % 8));
-  return (b & m) == m;
+int bit_isset(uint64 *array, uint64 index) {
+  return (array[index / BPW] >> (index % BPW)) & 1;
 }
 
 // Set bit at position index in array to 1
-void bit_set(char *array, int index) {
-  char b = array[index / 8];
-  char m = (1 << (index % 8));
-  array[index / 8] = (b | m);
+void bit_set(uint64 *array, uint64 index) {
+  array[index / BPW] |= 1L << (index % BPW);
 }
 
 // Clear bit at position index in array
-void bit_clear(char *array, int index) {
-  char b = array[index / 8];
-  char m = (1 << (index % 8));
-  array[index / 8] = (b & ~m);
+void bit_clear(uint64 *array, uint64 index) {
+  array[index / BPW] &= ~(1L << (index % BPW));
 }
 
 // Flip (invert) bit at position index in array
-void bit_flip(char *array, int index) {
-  char b = array[index / 8];
-  char m = (1 << (index % 8));
-  array[index / 8] = (b ^ m);
+void bit_flip(uint64 *array, uint64 index) {
+  array[index / BPW] ^= 1L << (index % BPW);
 }
 
-// Print a bit vector as a list of ranges of 1 bits
-void bd_print_vector(char *vector, int len) {
-  int last, lb;
-  last = 1;
-  lb = 0;
-  for (int b = 0; b < len; b++) {
-    if (last == bit_isset(vector, b)) continue;
-    if (last == 1) printf(" [%d, %d)", lb, b);
-    lb = b;
-    last = bit_isset(vector, b);
+// Set (set != 0) or clear bits [lo, hi) in array, a word at a time
+static void bit_range(uint64 *array, uint64 lo, uint64 hi, int set) {
+  uint64 w, m;
+
+  while (lo < hi) {
+    w = lo / BPW;
+    m = ~(uint64)0 << (lo % BPW);
+    if (hi < (w + 1) * BPW) m &= ((uint64)1 << (hi % BPW)) - 1;
+    if (set)
+      array[w] |= m;
+    else
+      array[w] &= ~m;
+    lo = (w + 1) * BPW;
   }
-  if (lb == 0 || last == 1) {
-    printf(" [%d, %d)", lb, len);
+}
+
+void bit_set_range(uint64 *array, uint64 lo, uint64 hi) {
+  bit_range(array, lo, hi, 1);
+}
+
+void bit_clear_range(uint64 *array, uint64 lo, uint64 hi) {
+  bit_range(array, lo, hi, 0);
+}
+
+// Index of the lowest 1 bit in x, which must not be 0. Done by
+// hand, since the compiler would call a libgcc helper.
+static int ctz64(uint64 x) {
+  int n = 0;
+
+  if ((x & 0xffffffff) == 0) { n += 32; x >>= 32; }
+  if ((x & 0xffff) == 0) { n += 16; x >>= 16; }
+  if ((x & 0xff) == 0) { n += 8; x >>= 8; }
+  if ((x & 0xf) == 0) { n += 4; x >>= 4; }
+  if ((x & 0x3) == 0) { n += 2; x >>= 2; }
+  if ((x & 0x1) == 0) n += 1;
+  return n;
+}
+
+// Find the first bit in [from, len) that is set, or clear if
+// invert is 1. Returns len if there is none.
+static uint64 bit_scan(uint64 *array, uint64 from, uint64 len, int invert) {
+  uint64 w, x;
+
+  while (from < len) {
+    w = from / BPW;
+    x = invert ? ~array[w] : array[w];
+    x &= ~(uint64)0 << (from % BPW);
+    if (x) {
+      from = w * BPW + ctz64(x);
+      return from < len ? from : len;
+    }
+    from = (w + 1) * BPW;
+  }
+  return len;
+}
+
+// Find first set bit at or after from; len if none
+uint64 bit_ffs(uint64 *array, uint64 from, uint64 len) {
+  return bit_scan(array, from, len, 0);
+}
+
+// Find first clear bit at or after from; len if none
+uint64 bit_ffz(uint64 *array, uint64 from, uint64 len) {
+  return bit_scan(array, from, len, 1);
+}
+
+// Print a bit vector as a list of ranges of 1 bits
+void bd_print_vector(uint64 *vector, uint64 len) {
+  uint64 lb, b;
+
+  for (lb = bit_ffs(vector, 0, len); lb < len; lb = bit_ffs(vector, b, len)) {
+    b = bit_ffz(vector, lb, len);
+    printf(" [%ld, %ld)", lb, b);
   }
   printf("\n");
 }
@@ -85,7 +150,7 @@ void bd_print_vector(char *vector, int len) {
 // Print buddy's data structures
 void bd_print() {
   for (int k = 0; k < nsizes; k++) {
-    printf("size %d (blksz %ld nblk %d): free list: ", k, BLK_SIZE(k), NBLK(k));
+    printf("size %d (blksz %ld nblk %ld): free list: ", k, BLK_SIZE(k), NBLK(k));
     lst_print(&bd_sizes[k].free);
     printf("  alloc:");
     bd_print_vector(bd_sizes[k].alloc, NBLK(k));
@@ -109,30 +174,27 @@ int firstk(uint64 n) {
 }
 
 // Compute the block index for address p at size k
-int blk_index(int k, char *p) {
-  int n = p - (char *)bd_base;
+uint64 blk_index(int k, char *p) {
+  uint64 n = p - (char *)bd_base;
   return n / BLK_SIZE(k);
 }
 
 // Convert a block index at size k back into an address
-void *addr(int k, int bi) {
-  int n = bi * BLK_SIZE(k);
+void *addr(int k, uint64 bi) {
+  uint64 n = bi * BLK_SIZE(k);
   return (char *)bd_base + n;
 }
 
-// allocate nbytes, but malloc won't return anything smaller than LEAF_SIZE
-void *bd_malloc(uint64 nbytes) {
-  int fk, k;
-
-  acquire(&lock);
+// Pop a free block of size fk, splitting a larger one if needed.
+// Caller must hold lock.
+static void *bd_alloc_locked(int fk) {
+  int k;
 
-  // Find a free block >= nbytes, starting with smallest k possible
-  fk = firstk(nbytes);
+  // Find a free block >= size fk, starting with smallest k possible
   for (k = fk; k < nsizes; k++) {
     if (!lst_empty(&bd_sizes[k].free)) break;
   }
   if (k >= nsizes) {  // No free blocks?
-    release(&lock);
     return 0;
   }
 
@@ -147,14 +209,40 @@ void *bd_malloc(uint64 nbytes) {
     bit_flip(bd_sizes[k - 1].alloc, blk_index(k - 1, p) / 2);
     lst_push(&bd_sizes[k - 1].free, q);
   }
-  release(&lock);
+  bd_order[blk_index(PGK, p)] = fk >= PGK ? fk : SUBPAGE;
+  return p;
+}
 
+// allocate nbytes, but malloc won't return anything smaller than LEAF_SIZE
+void *bd_malloc(uint64 nbytes) {
+  void *p;
+
+  acquire(&lock);
+  p = bd_alloc_locked(firstk(nbytes));
+  release(&lock);
   return p;
 }
 
+// Allocate up to n blocks of nbytes each into ps, taking the
+// lock only once. Returns the number of blocks allocated.
+int bd_malloc_batch(uint64 nbytes, void **ps, int n) {
+  int fk = firstk(nbytes);
+  int i;
+
+  acquire(&lock);
+  for (i = 0; i < n; i++) {
+    if ((ps[i] = bd_alloc_locked(fk)) == 0) break;
+  }
+  release(&lock);
+  return i;
+}
+
 // Find the size of the block that p points to.
 int size(char *p) {
-  for (int k = 0; k < nsizes; k++) {
+  int k = bd_order[blk_index(PGK, p)];
+
+  if (k != SUBPAGE) return k;
+  for (k = 0; k < PGK; k++) {
     if (bit_isset(bd_sizes[k + 1].split, blk_index(k + 1, p))) {
       return k;
     }
@@ -162,16 +250,14 @@ int size(char *p) {
   return 0;
 }
 
-// Free memory pointed to by p, which was earlier allocated using
-// bd_malloc.
-void bd_free(void *p) {
+// Free p, merging it with free buddies. Caller must hold lock.
+static void bd_free_locked(void *p) {
   void *q;
   int k;
 
-  acquire(&lock);
   for (k = size(p); k < MAXSIZE; k++) {
-    int bi = blk_index(k, p);
-    int buddy = (bi % 2 == 0) ? bi + 1 : bi - 1;
+    uint64 bi = blk_index(k, p);
+    uint64 buddy = (bi % 2 == 0) ? bi + 1 : bi - 1;
     int prev = bit_isset(bd_sizes[k].alloc, bi / 2);
     bit_flip(bd_sizes[k].alloc, bi / 2);
     if (prev == 0) {
@@ -187,12 +273,26 @@ void bd_free(void *p) {
     bit_clear(bd_sizes[k + 1].split, blk_index(k + 1, p));
   }
   lst_push(&bd_sizes[k].free, p);
+}
+
+// Free memory pointed to by p, which was earlier allocated using
+// bd_malloc.
+void bd_free(void *p) {
+  acquire(&lock);
+  bd_free_locked(p);
+  release(&lock);
+}
+
+// Free the n blocks in ps, taking the lock only once.
+void bd_free_batch(void **ps, int n) {
+  acquire(&lock);
+  for (int i = 0; i < n; i++) bd_free_locked(ps[i]);
   release(&lock);
 }
 
 // Compute the first block at size k that doesn't contain p
-int blk_index_next(int k, char *p) {
-  int n = (p - (char *)bd_base) / BLK_SIZE(k);
+uint64 blk_index_next(int k, char *p) {
+  uint64 n = (p - (char *)bd_base) / BLK_SIZE(k);
   if ((p - (char *)bd_base) % BLK_SIZE(k) != 0) n++;
   return n;
 }
@@ -208,7 +308,7 @@ int _log2(uint64 n) {
 
 // Mark memory from [start, stop), starting at size 0, as allocated.
 void bd_mark(void *start, void *stop) {
-  int bi, bj;
+  uint64 bi, bj;
 
   if (((uint64)start % LEAF_SIZE != 0) || ((uint64)stop % LEAF_SIZE != 0))
     panic("bd_mark");
@@ -216,23 +316,26 @@ void bd_mark(void *start, void *stop) {
   for (int k = 0; k < nsizes; k++) {
     bi = blk_index(k, start);
     bj = blk_index_next(k, stop);
-    for (; bi < bj; bi++) {
-      if (k > 0) {
-        // if a block is allocated at size k, mark it as split too.
-        bit_set(bd_sizes[k].split, bi);
-      }
-      bit_flip(bd_sizes[k].alloc, bi / 2);
+    if (bi >= bj) continue;
+    if (k > 0) {
+      // if a block is allocated at size k, mark it as split too.
+      bit_set_range(bd_sizes[k].split, bi, bj);
     }
+    // Allocating each block flips its pair's alloc bit, so pairs
+    // wholly inside [bi, bj) flip twice and end up unchanged; only
+    // a pair cut by either end of the range flips once.
+    if (bi % 2 == 1) bit_flip(bd_sizes[k].alloc, bi / 2);
+    if (bj % 2 == 1) bit_flip(bd_sizes[k].alloc, bj / 2);
   }
 }
 
 // Initialize the free lists for each size k.  For each size k, there
-int bd_initfree(void *bd_left, void *bd_right) {
-  int free = 0;
+uint64 bd_initfree(void *bd_left, void *bd_right) {
+  uint64 free = 0;
 
   for (int k = 0; k < MAXSIZE; k++) {  // skip max size
-    int left = blk_index_next(k, bd_left);
-    int right = blk_index(k, bd_right);
+    uint64 left = blk_index_next(k, bd_left);
+    uint64 right = blk_index(k, bd_right);
 
     if (left < NBLK(k)) {
       if (bit_isset(bd_sizes[k].alloc, left / 2)) {
@@ -245,8 +348,8 @@ int bd_initfree(void *bd_left, void *bd_right) {
 
     if (right < NBLK(k)) {
       if (bit_isset(bd_sizes[k].alloc, right / 2)) {
-        int buddy = (right % 2 == 0) ? right + 1 : right - 1;
-        if (buddy >= 0 && buddy < NBLK(k)) {
+        uint64 buddy = (right % 2 == 0) ? right + 1 : right - 1;
+        if (buddy < NBLK(k)) {
           lst_push(&bd_sizes[k].free, addr(k, buddy));
           free += BLK_SIZE(k);
         }
@@ -257,8 +360,8 @@ int bd_initfree(void *bd_left, void *bd_right) {
 }
 
 // Mark the range [bd_base,p) as allocated
-int bd_mark_data_structures(char *p) {
-  int meta = p - (char *)bd_base;
+uint64 bd_mark_data_structures(char *p) {
+  uint64 meta = p - (char *)bd_base;
 #ifndef DEBUG
   // printf("bd: %d meta bytes for managing %ld bytes of memory\n", meta,
   //        BLK_SIZE(MAXSIZE));
@@ -268,8 +371,8 @@ int bd_mark_data_structures(char *p) {
 }
 
 // Mark the range [end, HEAPSIZE) as allocated
-int bd_mark_unavailable(void *end, void *left) {
-  int unavailable = BLK_SIZE(MAXSIZE) - (end - bd_base);
+uint64 bd_mark_unavailable(void *end, void *left) {
+  uint64 unavailable = BLK_SIZE(MAXSIZE) - (end - bd_base);
   if (unavailable > 0) unavailable = ROUNDUP(unavailable, LEAF_SIZE);
 #ifndef DEBUG
   // printf("bd: 0x%x bytes unavailable\n", unavailable);
@@ -282,7 +385,8 @@ int bd_mark_unavailable(void *end, void *left) {
 // Initialize the buddy allocator: it manages memory from [base, end).
 void bd_init(void *base, void *end) {
   char *p = (char *)ROUNDUP((uint64)base, LEAF_SIZE);
-  int sz;
+  uint64 sz;
+  uint64 t0 = r_time();
 
   initlock(&lock, "buddy");
   bd_base = (void *)p;
@@ -304,9 +408,9 @@ void bd_init(void *base, void *end) {
   // initialize free list and allocate the alloc array for each size k
   for (int k = 0; k < nsizes; k++) {
     lst_init(&bd_sizes[k].free);
-    int pairs = (NBLK(k) + 1) / 2;
-    sz = sizeof(char) * ROUNDUP(pairs, 8) / 8;
-    bd_sizes[k].alloc = p;
+    uint64 pairs = (NBLK(k) + 1) / 2;
+    sz = ROUNDUP(pairs, BPW) / 8;
+    bd_sizes[k].alloc = (uint64 *)p;
     memset(bd_sizes[k].alloc, 0, sz);
     p += sz;
   }
@@ -314,28 +418,39 @@ void bd_init(void *base, void *end) {
   // allocate the split array for each size k, except for k = 0, since
   // we will not split blocks of size k = 0, the smallest size.
   for (int k = 1; k < nsizes; k++) {
-    sz = sizeof(char) * (ROUNDUP(NBLK(k), 8)) / 8;
-    bd_sizes[k].split = p;
+    sz = ROUNDUP(NBLK(k), BPW) / 8;
+    bd_sizes[k].split = (uint64 *)p;
     memset(bd_sizes[k].split, 0, sz);
     p += sz;
   }
+  // allocate the size map, one byte per page.
+  sz = HEAP_SIZE / PGSIZE;
+  bd_order = (uchar *)p;
+  memset(bd_order, 0, sz);
+  p += sz;
   p = (char *)ROUNDUP((uint64)p, LEAF_SIZE);
 
   // done allocating; mark the memory range [base, p) as allocated, so
   // that buddy will not hand out that memory.
-  int meta = bd_mark_data_structures(p);
+  uint64 meta = bd_mark_data_structures(p);
 
   // mark the unavailable memory range [end, HEAP_SIZE) as allocated,
   // so that buddy will not hand out that memory.
-  int unavailable = bd_mark_unavailable(end, p);
+  uint64 unavailable = bd_mark_unavailable(end, p);
   void *bd_end = bd_base + BLK_SIZE(MAXSIZE) - unavailable;
 
   // initialize free lists for each size k
-  int free = bd_initfree(p, bd_end);
+  uint64 free = bd_initfree(p, bd_end);
 
   // check if the amount that is free is what we expect
   if (free != BLK_SIZE(MAXSIZE) - meta - unavailable) {
-    printf("free %d %ld\n", free, BLK_SIZE(MAXSIZE) - meta - unavailable);
+    printf("free %ld %ld\n", free, BLK_SIZE(MAXSIZE) - meta - unavailable);
     panic("bd_init: free mem");
   }
+  bd_init_time = r_time() - t0;
+}
+
+// Print allocator statistics. No lock, like statdump().
+void bd_stats(void) {
+  printf("buddy: %d sizes, init took %ld timer ticks\n", nsizes, bd_init_time);
 }
@@ -7,6 +7,7 @@
 //   control-u -- kill line
 //   control-d -- end of file
 //   control-p -- print process list
+//   control-t -- print kernel statistics
 //
 
 #include <stdarg.h>
@@ -21,6 +22,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "proc.h"
+#include "poll.h"
+#include "fcntl.h"
 
 #define BACKSPACE 0x100
 #define C(x)  ((x)-'@')  // Control-x
@@ -50,6 +53,8 @@ struct {
   uint r;  // Read index
   uint w;  // Write index
   uint e;  // Edit index
+
+  struct pollq pq;  // poll()s waiting for input
 } cons;
 
 //
@@ -74,10 +79,11 @@ consolewrite(int user_src, uint64 src, int n)
 // user read()s from the console go here.
 // copy (up to) a whole input line to dst.
 // user_dist indicates whether dst is a user
-// or kernel address.
+// or kernel address. if nonblock, returns
+// EWOULDBLOCK rather than wait for a line.
 //
 int
-consoleread(int user_dst, uint64 dst, int n)
+consoleread(int user_dst, uint64 dst, int n, int nonblock)
 {
   uint target;
   int c;
@@ -93,6 +99,10 @@ consoleread(int user_dst, uint64 dst, int n)
         release(&cons.lock);
         return -1;
       }
+      if(nonblock){
+        release(&cons.lock);
+        return n < target ? target - n : EWOULDBLOCK;
+      }
       sleep(&cons.r, &cons.lock);
     }
 
@@ -126,6 +136,23 @@ consoleread(int user_dst, uint64 dst, int n)
   return target - n;
 }
 
+//
+// poll()s of the console go here.
+// input is ready when consoleread() would not sleep.
+//
+int
+consolepoll(struct pollent *pe)
+{
+  int r = POLLOUT;
+
+  acquire(&cons.lock);
+  pollqadd(&cons.pq, pe);
+  if(cons.r != cons.w)
+    r |= POLLIN;
+  release(&cons.lock);
+  return r;
+}
+
 //
 // the console input interrupt handler.
 // uartintr() calls this for input character.
@@ -141,6 +168,9 @@ consoleintr(int c)
   case C('P'):  // Print process list.
     procdump();
     break;
+  case C('T'):  // Print kernel statistics.
+    statdump();
+    break;
   case C('U'):  // Kill line.
     while(cons.e != cons.w &&
           cons.buf[(cons.e-1) % INPUT_BUF_SIZE] != '\n'){
@@ -170,6 +200,7 @@ consoleintr(int c)
         // has arrived.
         cons.w = cons.e;
         wakeup(&cons.r);
+        pollwake(&cons.pq);
       }
     }
     break;
@@ -182,6 +213,7 @@ void
 consoleinit(void)
 {
   initlock(&cons.lock, "cons");
+  pollqinit(&cons.pq);
 
   uartinit();
 
@@ -189,4 +221,5 @@ consoleinit(void)
   // to consoleread and consolewrite.
   devsw[CONSOLE].read = consoleread;
   devsw[CONSOLE].write = consolewrite;
+  devsw[CONSOLE].poll = consolepoll;
 }
@@ -3,9 +3,12 @@ struct context;
 struct file;
 struct inode;
 struct pipe;
+struct pollent;
+struct pollq;
 struct proc;
 struct spinlock;
 struct sleeplock;
+struct slabcache;
 struct stat;
 struct superblock;
 struct list;
@@ -13,10 +16,15 @@ struct list;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bclaim(uint, uint);
+void            breadahead(uint, uint*, int);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            bstats(void);
+int             bshrink(int);
 
 // console.c
 void            consoleinit(void);
@@ -34,10 +42,17 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filefcntl(struct file*, int, int);
+int             filesplice(struct file*, struct file*, int);
+int             filepoll(struct file*, struct pollent*);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
+void            dcinval(struct inode*, char*);
+void            dirunlink(struct inode*, char*, uint);
+int             hdirsize(struct inode*);
+void            dcstats(void);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
@@ -67,18 +82,34 @@ void            kinit(void);
 int             krefget(void*);
 void            krefdec(void*);
 void            krefinc(void*);
+void            kallocstats(void);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            logstats(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, int, uint64, int, int);
+int             pipewrite(struct pipe*, int, uint64, int, int);
+int             pipegetpage(struct pipe*, char**);
+int             pipeputpage(struct pipe*, char*);
+int             pipesize(struct pipe*);
+int             pipesetsize(struct pipe*, int);
+int             pipepoll(struct pipe*, int, struct pollent*);
+
+// poll.c
+void            pollinit(void);
+void            pollqinit(struct pollq*);
+void            pollqadd(struct pollq*, struct pollent*);
+void            pollwake(struct pollq*);
+void            polltick(void);
+int             poll(uint64, int, int);
 
 // printf.c
 int            printf(char*, ...) __attribute__ ((format (printf, 1, 2)));
@@ -110,6 +141,7 @@ void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+void            statdump(void);
 int             dump(void);
 int             dump2(int pid, int register_num, uint64* return_value);
 
@@ -182,7 +214,7 @@ int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 void            vmprint(pagetable_t);
 int             copy_on_write(pagetable_t, uint64);
-int             lazyalloc(pagetable_t pagetable, uint64 va, uint64 sz);
+int             lazyalloc(pagetable_t, uint64, uint64, int);
 
 // plic.c
 void            plicinit(void);
@@ -193,7 +225,10 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf **, int, int, void (*)(struct buf*));
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
+void            virtio_disk_stats(void);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -210,3 +245,16 @@ int            lst_empty(struct list*);
 void           bd_init(void*,void*);
 void           bd_free(void*);
 void           *bd_malloc(uint64);
+int            bd_malloc_batch(uint64, void**, int);
+void           bd_free_batch(void**, int);
+void           bd_stats(void);
+void           bit_set(uint64*, uint64);
+void           bit_clear(uint64*, uint64);
+uint64         bit_ffs(uint64*, uint64, uint64);
+uint64         bit_ffz(uint64*, uint64, uint64);
+
+// slab.c
+struct slabcache* slabcreate(char*, uint, void(*)(void*));
+void*           slaballoc(struct slabcache*);
+void            slabfree(struct slabcache*, void*);
+void            slabstats(void);
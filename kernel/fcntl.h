@@ -3,3 +3,14 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
+#define O_NONBLOCK 0x800
+
+// fcntl() commands
+#define F_GETPIPE_SZ 1   // size of a pipe's buffer
+#define F_SETPIPE_SZ 2   // resize a pipe's buffer
+#define F_GETFL      3   // status flags (O_NONBLOCK)
+#define F_SETFL      4   // set status flags
+
+// returned instead of sleeping by read() and write()
+// on an O_NONBLOCK file.
+#define EWOULDBLOCK  (-2)
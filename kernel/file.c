@@ -12,17 +12,21 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "fcntl.h"
+#include "poll.h"
 
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
   //struct file file[NFILE];
+  struct slabcache *cache;  // where struct files come from
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = slabcreate("file", sizeof(struct file), 0);
 }
 
 // Allocate a file structure.
@@ -31,7 +35,7 @@ filealloc(void)
 {
   struct file *f;
 
-  f = (struct file *) bd_malloc(sizeof(struct file));
+  f = (struct file *) slaballoc(ftable.cache);
   if (f == 0) {
     return 0;
   }
@@ -80,7 +84,7 @@ fileclose(struct file *f)
     end_op();
   }
 
-  bd_free(f);
+  slabfree(ftable.cache, f);
 }
 
 // Get metadata about file f.
@@ -102,10 +106,11 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
-// Read from file f.
-// addr is a user virtual address.
-int
-fileread(struct file *f, uint64 addr, int n)
+// Read from file f to addr, a user virtual address if
+// user_dst is 1, else a kernel address. If nonblock, pipes
+// and devices return EWOULDBLOCK rather than sleep.
+static int
+doread(struct file *f, int user_dst, uint64 addr, int n, int nonblock)
 {
   int r = 0;
 
@@ -113,14 +118,14 @@ fileread(struct file *f, uint64 addr, int n)
     return -1;
 
   if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+    r = piperead(f->pipe, user_dst, addr, n, nonblock);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
-    r = devsw[f->major].read(1, addr, n);
+    r = devsw[f->major].read(user_dst, addr, n, nonblock);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    if((r = readi(f->ip, user_dst, addr, f->off, n)) > 0)
       f->off += r;
     iunlock(f->ip);
   } else {
@@ -130,10 +135,19 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
-// Write to file f.
+// Read from file f.
 // addr is a user virtual address.
 int
-filewrite(struct file *f, uint64 addr, int n)
+fileread(struct file *f, uint64 addr, int n)
+{
+  return doread(f, 1, addr, n, f->flags & O_NONBLOCK);
+}
+
+// Write to file f from addr, a user virtual address if
+// user_src is 1, else a kernel address. If nonblock, a pipe
+// returns a short count or EWOULDBLOCK rather than sleep.
+static int
+dowrite(struct file *f, int user_src, uint64 addr, int n, int nonblock)
 {
   int r, ret = 0;
 
@@ -141,19 +155,20 @@ filewrite(struct file *f, uint64 addr, int n)
     return -1;
 
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    ret = pipewrite(f->pipe, user_src, addr, n, nonblock);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    ret = devsw[f->major].write(user_src, addr, n);
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // i-node, two indirect blocks for each level of
+    // the deepest tree, allocation blocks, and 2
+    // blocks of slop for non-aligned writes.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = ((MAXOPBLOCKS-1-6-1-2) / 2) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
@@ -162,7 +177,7 @@ filewrite(struct file *f, uint64 addr, int n)
 
       begin_op();
       ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
+      if ((r = writei(f->ip, user_src, addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
       end_op();
@@ -181,3 +196,130 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Write to file f.
+// addr is a user virtual address.
+int
+filewrite(struct file *f, uint64 addr, int n)
+{
+  return dowrite(f, 1, addr, n, f->flags & O_NONBLOCK);
+}
+
+// Get or set a property of file f; cmd is an F_ constant
+// from fcntl.h.
+int
+filefcntl(struct file *f, int cmd, int arg)
+{
+  switch(cmd){
+  case F_GETPIPE_SZ:
+    if(f->type != FD_PIPE)
+      return -1;
+    return pipesize(f->pipe);
+  case F_SETPIPE_SZ:
+    if(f->type != FD_PIPE)
+      return -1;
+    return pipesetsize(f->pipe, arg);
+  case F_GETFL:
+    return f->flags;
+  case F_SETFL:
+    f->flags = arg & O_NONBLOCK;
+    return 0;
+  }
+  return -1;
+}
+
+// Move up to n bytes from file in to file out, one of which
+// must be a pipe, without copying them through user space.
+// Data goes a page at a time through a kernel page, and
+// whole pages leave or enter a pipe by reference, so that a
+// page moving from pipe to pipe is not copied at all.
+// Stops early at end of file or a short read. Sleeps as
+// needed, whatever the files' O_NONBLOCK flags.
+// Returns the number of bytes moved, or -1.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  char *stage = 0, *pg;
+  int m, r = 0, w, tot;
+
+  if(in->readable == 0 || out->writable == 0)
+    return -1;
+  if(in->type != FD_PIPE && out->type != FD_PIPE)
+    return -1;
+
+  for(tot = 0; tot < n; tot += w){
+    m = n - tot < PGSIZE ? n - tot : PGSIZE;
+    r = 0;
+    if(in->type == FD_PIPE && m == PGSIZE)
+      r = pipegetpage(in->pipe, &pg);
+    if(r == 0){
+      if(stage == 0 && (stage = kalloc()) == 0){
+        r = -1;
+        break;
+      }
+      pg = stage;
+      r = doread(in, 0, (uint64)pg, m, 0);
+    }
+    if(r <= 0)
+      break;
+
+    w = 0;
+    if(out->type == FD_PIPE && r == PGSIZE)
+      w = pipeputpage(out->pipe, pg);
+    if(w == PGSIZE){
+      if(pg == stage)
+        stage = 0;    // now out's
+    } else {
+      if(w == 0)
+        w = dowrite(out, 0, (uint64)pg, r, 0);
+      if(pg != stage)
+        krefdec(pg);
+    }
+    if(w != r){
+      // the bytes read but not written are lost.
+      r = -1;
+      break;
+    }
+    if(r < m){
+      tot += w;
+      break;
+    }
+  }
+  if(stage)
+    krefdec(stage);
+  if(r < 0 && tot == 0)
+    return -1;
+  return tot;
+}
+
+// Report which of POLLIN, POLLOUT and POLLHUP hold for file f,
+// and put pe, if not 0, on the poll queue of f's object to hear
+// when that changes. An inode is readable while f's offset is
+// short of its end.
+int
+filepoll(struct file *f, struct pollent *pe)
+{
+  int r = 0;
+
+  if(f->type == FD_PIPE){
+    r = pipepoll(f->pipe, f->writable, pe);
+  } else if(f->type == FD_DEVICE){
+    if(f->major < 0 || f->major >= NDEV)
+      return POLLNVAL;
+    if(devsw[f->major].poll)
+      r = devsw[f->major].poll(pe);
+    else
+      r = POLLIN | POLLOUT;
+  } else if(f->type == FD_INODE){
+    ilock(f->ip);
+    pollqadd(&f->ip->pq, pe);
+    if(f->off < f->ip->size)
+      r |= POLLIN;
+    r |= POLLOUT;
+    iunlock(f->ip);
+  }
+  if(f->readable == 0)
+    r &= ~POLLIN;
+  if(f->writable == 0)
+    r &= ~POLLOUT;
+  return r;
+}
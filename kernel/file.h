@@ -1,8 +1,15 @@
+// poll() calls waiting for a change in some object; see poll.c.
+struct pollq {
+  struct spinlock lock;
+  struct pollent *head;
+};
+
 struct file {
   enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE } type;
   int ref; // reference count
   char readable;
   char writable;
+  int flags;         // status flags: O_NONBLOCK
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
@@ -18,6 +25,7 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct pollq pq;    // poll() calls waiting for the file to grow
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,13 +34,21 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+3];
+
+  uint mapbn;         // file block mapped by map[0]; 0 if map is unused
+  uint map[NINDIRECT]; // copy of the bottom indirect block bmap() used last
+
+  uint ranext;        // readahead: block a sequential read would read next
+  uint raend;         // first block not yet read ahead
+  uint rawin;         // blocks to keep read ahead
 };
 
 // map major device number to device functions.
 struct devsw {
-  int (*read)(int, uint64, int);
+  int (*read)(int, uint64, int, int);
   int (*write)(int, uint64, int);
+  int (*poll)(struct pollent*);
 };
 
 extern struct devsw devsw[];
@@ -26,6 +26,11 @@
 // only one device
 struct superblock sb; 
 
+static void freemapinit(int);
+static void imapinit(int);
+static void dcinit(void);
+static void dcpurge(uint, uint);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -44,6 +49,8 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  freemapinit(dev);
+  imapinit(dev);
 }
 
 // Zero a block.
@@ -59,27 +66,75 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// The free bitmap is summarized in memory by the number of free
+// blocks each bitmap block describes, so that balloc() reads only
+// bitmap blocks with free bits, and by a cursor just past the
+// last block allocated, where searches start when the caller has
+// no better idea. A bitmap block's count changes only while its
+// buffer is locked; others read the counts, and the cursor, as
+// hints.
+static struct {
+  int nbitmap;   // bitmap blocks
+  int *nfree;    // free blocks described by each
+  uint cursor;
+} freemap;
+
+// Count the free blocks described by each bitmap block.
+static void
+freemapinit(int dev)
+{
+  struct buf *bp;
+  uint64 *m;
+  int bb, bi, bj, end;
+
+  freemap.nbitmap = (sb.size + BPB - 1) / BPB;
+  freemap.nfree = bd_malloc(freemap.nbitmap * sizeof(int));
+  if(freemap.nfree == 0)
+    panic("freemapinit");
+  for(bb = 0; bb < freemap.nbitmap; bb++){
+    bp = bread(dev, BBLOCK(bb*BPB, sb));
+    m = (uint64*)bp->data;
+    end = min(BPB, sb.size - bb*BPB);
+    freemap.nfree[bb] = 0;
+    for(bi = bit_ffz(m, 0, end); bi < end; bi = bit_ffz(m, bj, end)){
+      bj = bit_ffs(m, bi, end);
+      freemap.nfree[bb] += bj - bi;
+    }
+    brelse(bp);
+  }
+  freemap.cursor = sb.size - sb.nblocks;  // first data block
+}
 
-// Allocate a zeroed disk block.
+// Allocate a zeroed disk block, the first free one at or after
+// hint if there is one, or else after the cursor if hint is 0.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint hint)
 {
-  int b, bi, m;
+  int b, bb, bb0, bi, k, end;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  if(hint == 0 || hint >= sb.size)
+    hint = freemap.cursor;
+  bb0 = hint / BPB;
+  // the last round searches the first bitmap block below hint.
+  for(k = 0; k <= freemap.nbitmap; k++){
+    bb = (bb0 + k) % freemap.nbitmap;
+    if(freemap.nfree[bb] == 0)
+      continue;
+    end = min(BPB, sb.size - bb*BPB);
+    bp = bread(dev, BBLOCK(bb*BPB, sb));
+    bi = bit_ffz((uint64*)bp->data, k == 0 ? hint % BPB : 0, end);
+    if(bi < end){
+      bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+      log_write(bp);
+      freemap.nfree[bb]--;
+      brelse(bp);
+      b = bb*BPB + bi;
+      freemap.cursor = b + 1;
+      bzero(dev, b);
+      return b;
     }
     brelse(bp);
   }
@@ -101,6 +156,7 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  freemap.nfree[b / BPB]++;
   brelse(bp);
 }
 
@@ -184,13 +240,50 @@ iinit()
   int i = 0;
   
   initlock(&itable.lock, "itable");
+  dcinit();
   for(i = 0; i < NINODE; i++) {
     initsleeplock(&itable.inode[i].lock, "inode");
+    pollqinit(&itable.inode[i].pq);
   }
 }
 
 static struct inode* iget(uint dev, uint inum);
 
+// Which inodes are free on disk, kept in memory so that ialloc()
+// need not read inode blocks to find one: a set bit means in
+// use. next is at or below the lowest free inode.
+static struct {
+  struct spinlock lock;
+  uint64 *map;
+  uint next;
+} imap;
+
+// Build imap from the inode blocks.
+static void
+imapinit(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  uint inum, i;
+
+  initlock(&imap.lock, "imap");
+  imap.map = bd_malloc((sb.ninodes + 63) / 64 * sizeof(uint64));
+  if(imap.map == 0)
+    panic("imapinit");
+  for(inum = 0; inum < sb.ninodes; inum += IPB){
+    bp = bread(dev, IBLOCK(inum, sb));
+    for(i = inum; i < inum + IPB && i < sb.ninodes; i++){
+      dip = (struct dinode*)bp->data + i%IPB;
+      if(i == 0 || dip->type != 0)  // inode 0 is never used
+        bit_set(imap.map, i);
+      else
+        bit_clear(imap.map, i);
+    }
+    brelse(bp);
+  }
+  imap.next = 1;
+}
+
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode,
@@ -198,24 +291,44 @@ static struct inode* iget(uint dev, uint inum);
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  uint inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
-    }
-    brelse(bp);
+  acquire(&imap.lock);
+  inum = bit_ffz(imap.map, imap.next, sb.ninodes);
+  if(inum < sb.ninodes){
+    bit_set(imap.map, inum);
+    imap.next = inum + 1;
+  } else {
+    imap.next = sb.ninodes;
   }
-  printf("ialloc: no inodes\n");
-  return 0;
+  release(&imap.lock);
+  if(inum >= sb.ninodes){
+    printf("ialloc: no inodes\n");
+    return 0;
+  }
+
+  bp = bread(dev, IBLOCK(inum, sb));
+  dip = (struct dinode*)bp->data + inum%IPB;
+  if(dip->type != 0)
+    panic("ialloc: inode in use");
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  log_write(bp);   // mark it allocated on the disk
+  brelse(bp);
+  return iget(dev, inum);
+}
+
+// Mark inode inum free in imap, once it is free on disk.
+static void
+ifree(uint inum)
+{
+  acquire(&imap.lock);
+  bit_clear(imap.map, inum);
+  if(inum < imap.next)
+    imap.next = inum;
+  release(&imap.lock);
 }
 
 // Copy a modified in-memory inode to disk.
@@ -271,6 +384,10 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ranext = 0;
+  ip->raend = 0;
+  ip->rawin = 0;
+  ip->mapbn = 0;
   release(&itable.lock);
 
   return ip;
@@ -348,8 +465,11 @@ iput(struct inode *ip)
     release(&itable.lock);
 
     itrunc(ip);
+    if(ip->type == T_DIR)
+      dcpurge(ip->dev, ip->inum);
     ip->type = 0;
     iupdate(ip);
+    ifree(ip->inum);
     ip->valid = 0;
 
     releasesleep(&ip->lock);
@@ -374,50 +494,103 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT], the NDINDIRECT after
+// those in the blocks listed in block ip->addrs[NDIRECT+1],
+// and the NTINDIRECT after those in a tree of indirect blocks
+// three deep whose root is ip->addrs[NDIRECT+2].
+
+// The block after prev, where balloc() should look first so
+// that files stay contiguous; no preference if prev is 0.
+#define NEXT(prev) ((prev) ? (prev) + 1 : 0)
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one, next to the
+// block before it if possible.
+// ip keeps a copy of the bottom-level indirect block it last
+// went through, so sequential access reads one indirect block
+// for every NINDIRECT data blocks.
 // returns 0 if out of disk space.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
+  uint addr, *a, fbn, span, idx;
   struct buf *bp;
+  int level, l;
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, bn > 0 ? NEXT(ip->addrs[bn-1]) : 0);
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
     }
     return addr;
   }
+
+  fbn = bn;
+  if(ip->mapbn && fbn - ip->mapbn < NINDIRECT && ip->map[fbn - ip->mapbn])
+    return ip->map[fbn - ip->mapbn];
+
+  // Which tree, and which of its blocks?
   bn -= NDIRECT;
+  for(level = 1, span = NINDIRECT; bn >= span; level++, span *= NINDIRECT){
+    if(level == 3)
+      panic("bmap: out of range");
+    bn -= span;
+  }
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
+  // Load the root, allocating if necessary.
+  if((addr = ip->addrs[NDIRECT+level-1]) == 0){
+    addr = balloc(ip->dev, NEXT(ip->addrs[NDIRECT+level-2]));
+    if(addr == 0)
+      return 0;
+    ip->addrs[NDIRECT+level-1] = addr;
+  }
+
+  // Walk down, allocating if necessary; span is the number
+  // of data blocks under each entry of the current level.
+  for(l = level, span /= NINDIRECT; l > 0; l--, span /= NINDIRECT){
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+    idx = bn / span;
+    bn %= span;
+    if((addr = a[idx]) == 0){
+      addr = balloc(ip->dev, idx > 0 ? NEXT(a[idx-1]) : NEXT(bp->blockno));
       if(addr){
-        a[bn] = addr;
+        a[idx] = addr;
         log_write(bp);
       }
     }
+    if(l == 1){
+      memmove(ip->map, a, BSIZE);
+      ip->mapbn = fbn - idx;
+    }
     brelse(bp);
-    return addr;
+    if(addr == 0)
+      return 0;
   }
+  return addr;
+}
+
+// Free the tree of indirect blocks, levels deep, rooted at
+// addr, and the data blocks it lists.
+static void
+bfreetree(uint dev, uint addr, int levels)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
 
-  panic("bmap: out of range");
+  if(levels > 0){
+    bp = bread(dev, addr);
+    a = (uint*)bp->data;
+    for(j = 0; j < NINDIRECT; j++){
+      if(a[j])
+        bfreetree(dev, a[j], levels - 1);
+    }
+    brelse(bp);
+  }
+  bfree(dev, addr);
 }
 
 // Truncate inode (discard contents).
@@ -425,9 +598,7 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -436,17 +607,13 @@ itrunc(struct inode *ip)
     }
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  for(i = 0; i < 3; i++){
+    if(ip->addrs[NDIRECT+i]){
+      bfreetree(ip->dev, ip->addrs[NDIRECT+i], i + 1);
+      ip->addrs[NDIRECT+i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
+  ip->mapbn = 0;
 
   ip->size = 0;
   iupdate(ip);
@@ -464,6 +631,40 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Sequential readahead: called by readi() for each block bn it
+// reads. While reads march through ip block by block, keep
+// asynchronous reads going for the blocks after bn, doubling
+// the window on each new block up to READAHEAD; any jump
+// starts over. Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint addrs[READAHEAD];
+  uint last;
+  int n;
+
+  if(bn + 1 == ip->ranext)  // same block as last time
+    return;
+  if(bn != ip->ranext){
+    ip->ranext = bn + 1;
+    ip->raend = bn + 1;
+    ip->rawin = 0;
+    return;
+  }
+  ip->ranext = bn + 1;
+  ip->rawin = ip->rawin == 0 ? 2 : min(2 * ip->rawin, READAHEAD);
+  if(ip->raend < bn + 1)
+    ip->raend = bn + 1;
+
+  last = min(bn + 1 + ip->rawin, (ip->size + BSIZE - 1) / BSIZE);
+  for(n = 0; ip->raend < last && n < READAHEAD; ip->raend++){
+    if((addrs[n] = bmap(ip, ip->raend)) == 0)
+      break;
+    n++;
+  }
+  breadahead(ip->dev, addrs, n);
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -483,6 +684,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
+    readahead(ip, off/BSIZE);
     bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
@@ -527,8 +729,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     brelse(bp);
   }
 
-  if(off > ip->size)
+  if(off > ip->size){
     ip->size = off;
+    pollwake(&ip->pq);
+  }
 
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
@@ -546,8 +750,292 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory entry cache: remembers the results of dirlookup(),
+// (directory, name) -> (inum, offset of the entry), including
+// names that are not there (inum 0), so that most path lookups
+// take a few hash probes instead of reading directories.
+// An entry can change only while its directory is locked:
+// dirlookup() fills the cache, and dirlink() and sys_unlink(),
+// the only writers of directories, update it. A deleted
+// directory still has "." and ".." entries, so iput() drops
+// them with dcpurge() before its inum can be reused.
+// Set-associative: a name hashes to a set of DCWAYS entries,
+// replaced round-robin.
+#define DCSETS  64
+#define DCWAYS  4
+
+struct dentry {
+  uint dev;
+  uint dir;              // inum of directory; 0 if entry unused
+  char name[DIRSIZ];
+  uint inum;             // 0 if name is not in dir
+  uint off;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry set[DCSETS][DCWAYS];
+  uchar next[DCSETS];    // way to replace next
+  uint64 hits;           // statistics
+  uint64 neghits;
+  uint64 misses;
+} dcache;
+
+static void
+dcinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static uint
+dchash(uint dev, uint dir, char *name)
+{
+  return (dirhash(name) ^ dev ^ (dir * 16777619)) % DCSETS;
+}
+
+// Find (dp, name) in set h. Caller must hold dcache.lock.
+static struct dentry*
+dcfind(uint h, struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.set[h]; d < &dcache.set[h][DCWAYS]; d++){
+    if(d->dir == dp->inum && d->dev == dp->dev && namecmp(d->name, name) == 0)
+      return d;
+  }
+  return 0;
+}
+
+// Look up (dp, name). Returns 1 and sets *inum and *off on a hit.
+static int
+dcget(struct inode *dp, char *name, uint *inum, uint *off)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dchash(dp->dev, dp->inum, name), dp, name)) != 0){
+    *inum = d->inum;
+    *off = d->off;
+    if(d->inum)
+      dcache.hits++;
+    else
+      dcache.neghits++;
+  } else {
+    dcache.misses++;
+  }
+  release(&dcache.lock);
+  return d != 0;
+}
+
+// Remember that name is at off in dp, as inum (0 if not there).
+static void
+dcput(struct inode *dp, char *name, uint inum, uint off)
+{
+  uint h = dchash(dp->dev, dp->inum, name);
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(h, dp, name)) == 0){
+    d = &dcache.set[h][dcache.next[h]];
+    dcache.next[h] = (dcache.next[h] + 1) % DCWAYS;
+  }
+  d->dev = dp->dev;
+  d->dir = dp->inum;
+  strncpy(d->name, name, DIRSIZ);
+  d->inum = inum;
+  d->off = off;
+  release(&dcache.lock);
+}
+
+// Forget what the cache knows about name in dp.
+// Caller must hold dp's lock.
+void
+dcinval(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dchash(dp->dev, dp->inum, name), dp, name)) != 0)
+    d->dir = 0;
+  release(&dcache.lock);
+}
+
+// Forget every entry of directory inum on dev, which is being
+// freed. Scans the whole cache, but directories are rarely freed.
+static void
+dcpurge(uint dev, uint inum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(int h = 0; h < DCSETS; h++){
+    for(d = dcache.set[h]; d < &dcache.set[h][DCWAYS]; d++){
+      if(d->dir == inum && d->dev == dev)
+        d->dir = 0;
+    }
+  }
+  release(&dcache.lock);
+}
+
+// Print directory entry cache statistics. No locks, like statdump().
+void
+dcstats(void)
+{
+  printf("dcache: %ld hits, %ld negative hits, %ld misses\n",
+         dcache.hits, dcache.neghits, dcache.misses);
+}
+
+// Hashed directories; see fs.h. dp->minor is the number of
+// buckets, and bucket b is block b of dp. The overflow blocks
+// run from block dp->minor to the end of dp.
+
+#define HASHED(dp) ((dp)->major == DIRHASH)
+
+// Search the overflow blocks of hashed directory dp for name, or
+// for a free entry if name is 0, reading the entry into *de.
+// Returns its offset, or dp->size if there is none.
+static uint
+hdirspill(struct inode *dp, char *name, struct dirent *de)
+{
+  uint off;
+
+  for(off = dp->minor*BSIZE; off < dp->size; off += sizeof(*de)){
+    if(readi(dp, 0, (uint64)de, off, sizeof(*de)) != sizeof(*de))
+      panic("hdirspill read");
+    if(name == 0 ? de->inum == 0 : de->inum != 0 && namecmp(name, de->name) == 0)
+      break;
+  }
+  return off;
+}
+
+// Look name up in hashed directory dp. Returns its inum and sets
+// *poff, or returns 0.
+static uint
+hdirlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint h = dirhash(name) % dp->minor, b, off, inum = 0;
+  struct buf *bp;
+  struct dirent *de, d;
+  struct dirhdr *hd;
+  int k, i, over = 0, spill = 0;
+
+  *poff = 0;
+  for(k = 0; k < DIRPROBE; k++){
+    b = (h + k) % dp->minor;
+    bp = bread(dp->dev, bmap(dp, b));
+    de = (struct dirent*)bp->data;
+    for(i = 1; i < DPB; i++){
+      if(de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+        inum = de[i].inum;
+        *poff = b*BSIZE + i*sizeof(*de);
+        break;
+      }
+    }
+    if(k == 0){
+      hd = (struct dirhdr*)bp->data;
+      over = hd->over;
+      spill = hd->spill;
+    }
+    brelse(bp);
+    if(inum || over == 0)
+      break;
+  }
+  if(inum == 0 && spill > 0 && (off = hdirspill(dp, name, &d)) < dp->size){
+    inum = d.inum;
+    *poff = off;
+  }
+  return inum;
+}
+
+// Add bucket b's header field f, a member of struct dirhdr, to n.
+#define HDRADD(dp, b, f, n) do { \
+    struct buf *_bp = bread((dp)->dev, bmap((dp), (b))); \
+    ((struct dirhdr*)_bp->data)->f += (n); \
+    log_write(_bp); \
+    brelse(_bp); \
+  } while(0)
+
+// Add (name, inum), which is not there, to hashed directory dp,
+// in the overflow blocks if its buckets are full.
+// Returns the entry's offset, or -1 if it cannot be written.
+static int
+hdirlink(struct inode *dp, char *name, uint inum)
+{
+  uint h = dirhash(name) % dp->minor, b, off;
+  struct buf *bp;
+  struct dirhdr *hd;
+  struct dirent *de, d;
+  int k, i;
+
+  for(k = 0; k < DIRPROBE; k++){
+    b = (h + k) % dp->minor;
+    bp = bread(dp->dev, bmap(dp, b));
+    hd = (struct dirhdr*)bp->data;
+    if(hd->nent < DPB - 1)
+      break;
+    brelse(bp);
+  }
+  if(k == DIRPROBE){
+    off = hdirspill(dp, 0, &d);
+    strncpy(d.name, name, DIRSIZ);
+    d.inum = inum;
+    if(writei(dp, 0, (uint64)&d, off, sizeof(d)) != sizeof(d))
+      return -1;
+    HDRADD(dp, h, spill, 1);
+    HDRADD(dp, 0, total, 1);
+    return off;
+  }
+
+  de = (struct dirent*)bp->data;
+  for(i = 1; de[i].inum != 0; i++)
+    ;
+  strncpy(de[i].name, name, DIRSIZ);
+  de[i].inum = inum;
+  hd->nent++;
+  log_write(bp);
+  brelse(bp);
+  if(k > 0)
+    HDRADD(dp, h, over, 1);
+  HDRADD(dp, 0, total, 1);
+  return b*BSIZE + i*sizeof(*de);
+}
+
+// Remove the entry for name at off from hashed directory dp.
+static void
+hdirunlink(struct inode *dp, char *name, uint off)
+{
+  uint h = dirhash(name) % dp->minor, b = off / BSIZE;
+  struct buf *bp;
+
+  bp = bread(dp->dev, bmap(dp, b));
+  memset(bp->data + off % BSIZE, 0, sizeof(struct dirent));
+  if(b < dp->minor)
+    ((struct dirhdr*)bp->data)->nent--;
+  log_write(bp);
+  brelse(bp);
+  if(b >= dp->minor)
+    HDRADD(dp, h, spill, -1);
+  else if(b != h)
+    HDRADD(dp, h, over, -1);
+  HDRADD(dp, 0, total, -1);
+}
+
+// Number of entries, including "." and "..", in hashed directory dp.
+int
+hdirsize(struct inode *dp)
+{
+  struct buf *bp;
+  int n;
+
+  bp = bread(dp->dev, bmap(dp, 0));
+  n = ((struct dirhdr*)bp->data)->total;
+  brelse(bp);
+  return n;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Caller must hold dp's lock.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
@@ -557,6 +1045,16 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dcget(dp, name, &inum, &off))
+    goto found;
+
+  if(HASHED(dp)){
+    inum = hdirlookup(dp, name, &off);
+    dcput(dp, name, inum, off);
+    goto found;
+  }
+
+  inum = 0;
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -564,14 +1062,18 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       continue;
     if(namecmp(name, de.name) == 0){
       // entry matches path element
-      if(poff)
-        *poff = off;
       inum = de.inum;
-      return iget(dp->dev, inum);
+      break;
     }
   }
+  dcput(dp, name, inum, off);
 
-  return 0;
+ found:
+  if(inum == 0)
+    return 0;
+  if(poff)
+    *poff = off;
+  return iget(dp->dev, inum);
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
@@ -589,6 +1091,13 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  if(HASHED(dp)){
+    if((off = hdirlink(dp, name, inum)) < 0)
+      return -1;
+    dcput(dp, name, inum, off);
+    return 0;
+  }
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -599,12 +1108,32 @@ dirlink(struct inode *dp, char *name, uint inum)
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de)){
+    dcinval(dp, name);
     return -1;
+  }
+  dcput(dp, name, inum, off);
 
   return 0;
 }
 
+// Remove the entry for name, found by dirlookup() at off,
+// from directory dp. Caller must hold dp's lock.
+void
+dirunlink(struct inode *dp, char *name, uint off)
+{
+  struct dirent de;
+
+  if(HASHED(dp)){
+    hdirunlink(dp, name, off);
+  } else {
+    memset(&de, 0, sizeof(de));
+    if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+      panic("unlink: writei");
+  }
+  dcinval(dp, name);
+}
+
 // Paths
 
 // Copy the next path element from path into name.
@@ -24,9 +24,13 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+// A file's blocks: NDIRECT direct blocks, then the blocks of
+// single, double and triple indirect trees.
+#define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define NTINDIRECT (NDINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT + NTINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +39,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+3];   // Data block addresses, then indirect trees
 };
 
 // Inodes per block.
@@ -58,3 +62,36 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+
+// A hashed directory, made by mkfs -h, is a T_DIR inode with
+// major DIRHASH and minor blocks. Each block is a bucket of the
+// names that hash to it, or, if it is full, to the bucket before
+// it; names go at most DIRPROBE buckets from their own. A name
+// whose buckets are all full goes in the overflow blocks after
+// the last bucket, which hold plain dirents searched linearly.
+// The first dirent of a bucket is a struct dirhdr, whose inum is
+// 0 so that it reads as an unused entry, and the directory still
+// reads as an ordinary sequence of dirents.
+#define DIRHASH  1
+#define DIRPROBE 2
+#define DPB      (BSIZE / sizeof(struct dirent))  // dirents per block
+
+struct dirhdr {
+  ushort inum;     // always 0
+  ushort nent;     // entries in this bucket
+  ushort over;     // entries that passed this bucket because it was full
+  ushort spill;    // entries that passed all DIRPROBE buckets
+  uint total;      // bucket 0 only: entries in the directory
+  uint pad2;
+};
+
+// Hash of a directory entry name, for hashed directories.
+static inline uint
+dirhash(const char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (unsigned char)name[i]) * 16777619;
+  return h;
+}
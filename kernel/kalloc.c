@@ -1,6 +1,14 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Each CPU keeps a small cache of free pages in front of the
+// buddy allocator, refilled from and drained to it KBATCH pages
+// at a time, so most kalloc() and kfree() calls only take the
+// CPU's own lock. A CPU whose cache is empty when the buddy
+// allocator has run dry steals from the other CPUs' caches,
+// and when they are empty too the buffer cache is asked to
+// give memory back.
 
 #include "types.h"
 #include "param.h"
@@ -8,6 +16,10 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "fs.h"
+
+#define KBATCH   16            // pages moved per refill or drain
+#define KCACHEMAX (4*KBATCH)   // drain a CPU's cache beyond this
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
@@ -16,21 +28,90 @@ struct run {
   struct run *next;
 };
 
-struct {
+struct kcache {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int n;                 // pages on freelist
+  uint64 allocs;         // statistics
+  uint64 refills;
+  uint64 drains;
+  uint64 steals;
+} kcache[NCPU];
 
-struct spinlock kreflock;
-int kref_count[PHYSTOP / PGSIZE];
+// Page reference counts, indexed from KERNBASE since
+// no page below it is ever allocated.
+// Updated with atomic instructions, so no lock is needed.
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+int kref_count[(PHYSTOP - KERNBASE) / PGSIZE];
 
 void
 kinit()
 {
-  initlock(&kreflock, "ref_counter");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kcache[i].lock, "kcache");
   bd_init((char*)PGROUNDUP((uint64)end), (void*)PHYSTOP);
 }
 
+// Move up to KBATCH pages from the buddy allocator into c.
+// Caller must hold c->lock.
+static void
+krefill(struct kcache *c)
+{
+  void *pages[KBATCH];
+  struct run *r;
+  int n;
+
+  n = bd_malloc_batch(PGSIZE, pages, KBATCH);
+  for(int i = 0; i < n; i++){
+    r = (struct run*)pages[i];
+    r->next = c->freelist;
+    c->freelist = r;
+  }
+  c->n += n;
+  c->refills++;
+}
+
+// Return KBATCH pages from c to the buddy allocator.
+// Caller must hold c->lock.
+static void
+kdrain(struct kcache *c)
+{
+  void *pages[KBATCH];
+  int n;
+
+  for(n = 0; n < KBATCH && c->freelist; n++){
+    pages[n] = c->freelist;
+    c->freelist = c->freelist->next;
+  }
+  c->n -= n;
+  c->drains++;
+  bd_free_batch(pages, n);
+}
+
+// Take a page from another CPU's cache; memory is short.
+static struct run *
+ksteal(int self)
+{
+  struct kcache *c;
+  struct run *r;
+
+  for(int i = 0; i < NCPU; i++){
+    if(i == self)
+      continue;
+    c = &kcache[i];
+    acquire(&c->lock);
+    if((r = c->freelist) != 0){
+      c->freelist = r->next;
+      c->n--;
+      c->steals++;
+    }
+    release(&c->lock);
+    if(r)
+      return r;
+  }
+  return 0;
+}
+
 // Free the page of physical memory pointed at by pa,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
@@ -38,12 +119,52 @@ kinit()
 void
 kfree(void *pa)
 {
+  struct kcache *c;
+  struct run *r;
+
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
-  bd_free(pa);
+
+  r = (struct run*)pa;
+  push_off();
+  c = &kcache[cpuid()];
+  acquire(&c->lock);
+  r->next = c->freelist;
+  c->freelist = r;
+  if(++c->n > KCACHEMAX)
+    kdrain(c);
+  release(&c->lock);
+  pop_off();
+}
+
+// Take a page from this CPU's cache, refilling it from the
+// buddy allocator, or from another CPU's cache.
+static struct run *
+kget(void)
+{
+  struct kcache *c;
+  struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
+  c = &kcache[id];
+  acquire(&c->lock);
+  if(c->freelist == 0)
+    krefill(c);
+  if((r = c->freelist) != 0){
+    c->freelist = r->next;
+    c->n--;
+  }
+  c->allocs++;
+  release(&c->lock);
+  if(r == 0)
+    r = ksteal(id);
+  pop_off();
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -52,13 +173,18 @@ kfree(void *pa)
 void *
 kalloc(void)
 {
-  void *r = bd_malloc(PGSIZE);
-  
+  struct run *r;
+
+  // when memory runs out, shrink the buffer cache and retry once.
+  // buffer data are scattered 1 KiB blocks that need not merge
+  // into pages, so retrying until a page turns up could empty
+  // the whole cache for nothing.
+  if((r = kget()) == 0 && bshrink(KBATCH * (PGSIZE / BSIZE)) > 0)
+    r = kget();
+
   if(r) {
     memset((char*)r, 5, PGSIZE); // fill with junk
-    acquire(&kreflock);
-    kref_count[(uint64)r / PGSIZE] = 1;
-    release(&kreflock);
+    kref_count[PA2REF(r)] = 1;
   }
   return (void*)r;
 }
@@ -68,10 +194,8 @@ krefinc(void *pa)
 {
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     return;
-  
-  acquire(&kreflock);
-  kref_count[(uint64)pa / PGSIZE]++;
-  release(&kreflock);
+
+  __sync_fetch_and_add(&kref_count[PA2REF(pa)], 1);
 }
 
 void
@@ -79,14 +203,9 @@ krefdec(void *pa)
 {
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     return;
-  
-  acquire(&kreflock);
-  kref_count[(uint64)pa / PGSIZE]--;
 
-  if(kref_count[(uint64)pa / PGSIZE] == 0) {
+  if(__sync_sub_and_fetch(&kref_count[PA2REF(pa)], 1) == 0)
     kfree(pa);
-  }
-  release(&kreflock);
 }
 
 int
@@ -94,8 +213,27 @@ krefget(void *pa)
 {
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     return 0;
-    
-  int refs = kref_count[(uint64)pa / PGSIZE];
+
+  int refs = kref_count[PA2REF(pa)];
 
   return refs;
 }
+
+// Print page allocator statistics, summed over CPUs.
+// No locks, like statdump().
+void
+kallocstats(void)
+{
+  uint64 allocs = 0, refills = 0, drains = 0, steals = 0;
+  int cached = 0;
+
+  for(int i = 0; i < NCPU; i++){
+    allocs += kcache[i].allocs;
+    refills += kcache[i].refills;
+    drains += kcache[i].drains;
+    steals += kcache[i].steals;
+    cached += kcache[i].n;
+  }
+  printf("kalloc: %ld allocs, %ld refills, %ld drains, %ld steals, %d pages cached\n",
+         allocs, refills, drains, steals, cached);
+}
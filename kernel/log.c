@@ -10,131 +10,243 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. A transaction commits only when it has no FS system
+// calls active. Thus there is never any reasoning required
+// about whether a commit might write an uncommitted system
+// call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the transaction ahead of it commits.
+//
+// Group commit: there are two in-memory transactions. While
+// one is being written to disk, new system calls join the
+// other, so one disk commit carries the updates of all the
+// system calls that arrived during the previous commit.
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// Each commit appends one record to it:
+//   header block, containing a sequence number, a checksum,
+//     and block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// The header and the blocks are written together, in a single
+// batch of disk requests; the checksum, which covers both, tells
+// recovery whether the whole record made it to disk, so writing
+// the header is the true point at which a transaction commits.
+//
+// Committed blocks are not written to their home locations
+// right away. They stay pinned in the buffer cache while records
+// accumulate in the log, and when the log is nearly full a
+// checkpoint writes each of them home once, however many records
+// it appears in, and the log starts again from its beginning.
+// The log is never erased: recovery replays the chain of valid
+// records with consecutive sequence numbers starting at the
+// beginning of the log, which redoes any checkpoint that was
+// cut short and is harmless otherwise.
+
+// most blocks in one record: what fits in its header block.
+#define LOGHDR ((int)(BSIZE / sizeof(uint)) - 3)
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
+  uint seq;       // commit sequence number
+  uint checksum;  // of seq, n, block[], and the record's blocks
   int n;
-  int block[LOGSIZE];
+  int block[LOGHDR];
+};
+
+struct trans {
+  int outstanding; // how many FS sys calls are executing.
+  struct logheader lh;
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
-  int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int size;        // blocks in the on-disk log
   int dev;
-  struct logheader lh;
+  struct trans trans[2];
+  int cur;         // trans[cur] takes new FS sys calls.
+  int committing;  // the other one is being written.
+  int closing;     // trans[cur] is about to be; please wait.
+  int used;        // log blocks holding records since the checkpoint
+  uint seq;        // of the next record
+
+  // committed blocks not yet written home, each pinned once.
+  int npending;
+  uint pending[LOGSIZE];
+
+  // for the committer only.
+  struct buf *bufs[LOGSIZE];
+  struct buf *tos[1+LOGHDR];
+
+  // statistics
+  uint64 ops;
+  uint64 commits;
+  uint64 blocks;      // logged
+  uint64 checkpoints;
+  uint64 installed;   // blocks written home by checkpoints
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void commit(struct trans *t);
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  if (sizeof(struct logheader) != BSIZE)
+    panic("initlog: bad logheader");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  if (log.size > LOGSIZE)
+    log.size = LOGSIZE;
+  if (log.size < 1 + 3*MAXOPBLOCKS)
+    panic("initlog: log too small");
   log.dev = dev;
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
-static void
-install_trans(int recovering)
+#define FNV(h, w) (((h) ^ (w)) * 16777619)
+
+// Checksum of the record with header lh, whose blocks'
+// contents are in data[0..lh->n-1].
+static uint
+logsum(struct logheader *lh, struct buf **data)
 {
-  int tail;
+  uint h = 2166136261;
+  uint *w;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  h = FNV(h, lh->seq);
+  h = FNV(h, lh->n);
+  for (int i = 0; i < lh->n; i++)
+    h = FNV(h, lh->block[i]);
+  for (int i = 0; i < lh->n; i++) {
+    w = (uint*)data[i]->data;
+    for (int j = 0; j < BSIZE / sizeof(uint); j++)
+      h = FNV(h, w[j]);
   }
+  return h;
 }
 
-// Read the log header from disk into the in-memory log header
-static void
-read_head(void)
+// Read the header of a record at log block pos into lh, and
+// its blocks into log.tos. Returns 1, with the blocks locked,
+// if the record is whole; 0, with nothing locked, if not.
+static int
+read_record(int pos, struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  struct buf *buf = bread(log.dev, log.start+pos);
+  struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
+
+  *lh = *hb;
   brelse(buf);
+  if (lh->n <= 0 || lh->n > LOGHDR || pos+1+lh->n > log.size)
+    return 0;
+  for (i = 0; i < lh->n; i++)
+    log.tos[i] = bread(log.dev, log.start+pos+1+i);
+  if (logsum(lh, log.tos) == lh->checksum)
+    return 1;
+  for (i = 0; i < lh->n; i++)
+    brelse(log.tos[i]);
+  return 0;
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Copy the blocks of the record just read by read_record()
+// to their home locations.
 static void
-write_head(void)
+replay_record(struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  struct buf **dbufs = log.bufs;
+  int tail;
+
+  breadahead(log.dev, (uint*)lh->block, lh->n);
+  for (tail = 0; tail < lh->n; tail++) {
+    dbufs[tail] = bread(log.dev, lh->block[tail]); // read dst
+    memmove(dbufs[tail]->data, log.tos[tail]->data, BSIZE);  // copy block to dst
+    brelse(log.tos[tail]);
   }
-  bwrite(buf);
-  brelse(buf);
+  bwritev(dbufs, lh->n);  // write all dsts to disk at once
+  for (tail = 0; tail < lh->n; tail++)
+    brelse(dbufs[tail]);
 }
 
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct logheader *lh = &log.trans[0].lh;
+  uint maxseq = 0;
+  int pos, i, n;
+
+  // nothing is cached yet: read the log in a few large requests.
+  for (pos = 0; pos < log.size; pos += n) {
+    n = log.size - pos < LOGHDR ? log.size - pos : LOGHDR;
+    for (i = 0; i < n; i++)
+      log.pending[i] = log.start+pos+i;
+    breadahead(log.dev, log.pending, n);
+  }
+
+  // Records from before the last checkpoint may survive beyond
+  // the end of the chain; new records must have later sequence
+  // numbers than any of them.
+  for (pos = 0; pos < log.size; pos++) {
+    if (read_record(pos, lh)) {
+      if (lh->seq > maxseq)
+        maxseq = lh->seq;
+      for (i = 0; i < lh->n; i++)
+        brelse(log.tos[i]);
+    }
+  }
+
+  // Redo the committed transactions since the last checkpoint.
+  for (pos = 0; pos < log.size && read_record(pos, lh); pos += 1+lh->n) {
+    if (pos > 0 && lh->seq != log.seq) {
+      for (i = 0; i < lh->n; i++)
+        brelse(log.tos[i]);
+      break;
+    }
+    replay_record(lh);
+    log.seq = lh->seq + 1;
+  }
+
+  log.seq = maxseq + 1;
+  log.used = 0;
+  lh->n = 0;
+}
+
+// Blocks available to the open transaction.
+static int
+logroom(void)
+{
+  int room = log.size - log.used - 1;
+  return room < LOGHDR ? room : LOGHDR;
 }
 
 // called at the start of each FS system call.
 void
 begin_op(void)
 {
+  struct trans *t;
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    t = &log.trans[log.cur];
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(t->lh.n + (t->outstanding+1)*MAXOPBLOCKS > logroom()){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
-      log.outstanding += 1;
+      t->outstanding += 1;
+      log.ops++;
       release(&log.lock);
       break;
     }
@@ -142,64 +254,149 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation
+// and no commit is under way; otherwise the current
+// commit picks this transaction up when it is done.
 void
 end_op(void)
 {
+  struct trans *t;
   int do_commit = 0;
 
   acquire(&log.lock);
-  log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  t = &log.trans[log.cur];
+  t->outstanding -= 1;
+  if(log.closing)
+    panic("log.closing");
+  if(t->outstanding == 0 && !log.committing){
     do_commit = 1;
     log.committing = 1;
+    log.closing = 1;
   } else {
     // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
+    // and decrementing outstanding has decreased
     // the amount of reserved space.
     wakeup(&log);
   }
   release(&log.lock);
 
-  if(do_commit){
+  while(do_commit){
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
-    commit();
+    commit(t);
     acquire(&log.lock);
-    log.committing = 0;
+    // did the next transaction finish while we committed?
+    t = &log.trans[log.cur];
+    if(t->outstanding > 0 || t->lh.n == 0){
+      do_commit = 0;
+      log.committing = 0;
+    } else {
+      log.closing = 1;
+    }
     wakeup(&log);
     release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy t's blocks into a record at log block pos, in log.tos,
+// and add them to the pending blocks. The blocks are locked in
+// log.bufs, and stay pinned for the checkpoint.
 static void
-write_log(void)
+write_log(struct trans *t, int pos)
 {
-  int tail;
+  struct buf **tos = log.tos;
+  struct logheader *hb;
+  int tail, i;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < t->lh.n; tail++) {
+    tos[1+tail] = bclaim(log.dev, log.start+pos+1+tail); // log block
+    memmove(tos[1+tail]->data, log.bufs[tail]->data, BSIZE);
+    for (i = 0; i < log.npending; i++)
+      if (log.pending[i] == t->lh.block[tail])
+        break;
+    if (i < log.npending)
+      bunpin(log.bufs[tail]);  // pinned by an earlier record
+    else
+      log.pending[log.npending++] = t->lh.block[tail];
   }
+  t->lh.seq = log.seq++;
+  t->lh.checksum = logsum(&t->lh, tos+1);
+  tos[0] = bclaim(log.dev, log.start+pos);
+  hb = (struct logheader *) (tos[0]->data);
+  *hb = t->lh;
 }
 
+// Write every pending block home and empty the log.
+// The blocks must hold committed contents, so no FS
+// sys call may be active.
 static void
-commit()
+checkpoint(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  int i;
+
+  for (i = 0; i < log.npending; i++)
+    log.bufs[i] = bread(log.dev, log.pending[i]);  // pinned, so cached
+  bwritev(log.bufs, log.npending);
+  for (i = 0; i < log.npending; i++) {
+    bunpin(log.bufs[i]);
+    brelse(log.bufs[i]);
   }
+  log.checkpoints++;
+  log.installed += log.npending;
+  log.npending = 0;
+}
+
+// Commit t, which is trans[cur] and has no FS sys calls active.
+// Caller must have set log.committing and log.closing, so
+// that new FS sys calls wait while t's blocks are copied into
+// the log; then they start on the other transaction.
+static void
+commit(struct trans *t)
+{
+  int pos = log.used, n = t->lh.n, ckpt, i;
+
+  if (n > 0) {
+    for (i = 0; i < n; i++)
+      log.bufs[i] = bread(log.dev, t->lh.block[i]);  // pinned, so cached
+    write_log(t, pos);
+    for (i = 0; i < n; i++)
+      brelse(log.bufs[i]);
+  }
+
+  // Checkpoint if the next transaction would have little room;
+  // new FS sys calls wait, so that the pending blocks in the
+  // cache are the committed ones.
+  ckpt = n > 0 && log.size - (pos+1+n) - 1 < 3*MAXOPBLOCKS;
+
+  if (!ckpt) {
+    acquire(&log.lock);
+    log.closing = 0;
+    if (n > 0) {
+      log.cur ^= 1;
+      log.used = pos+1+n;
+    }
+    wakeup(&log);
+    release(&log.lock);
+    if (n == 0)
+      return;
+  }
+
+  bwritev(log.tos, 1+n);  // Write the record -- the real commit
+  for (i = 0; i < 1+n; i++)
+    brelse(log.tos[i]);
+  log.commits++;
+  log.blocks += n;
+
+  if (ckpt) {
+    checkpoint();
+    acquire(&log.lock);
+    log.closing = 0;
+    log.cur ^= 1;
+    log.used = 0;
+    wakeup(&log);
+    release(&log.lock);
+  }
+  t->lh.n = 0;
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -214,23 +411,35 @@ commit()
 void
 log_write(struct buf *b)
 {
+  struct logheader *lh;
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  lh = &log.trans[log.cur].lh;
+  if (lh->n >= logroom())
     panic("too big a transaction");
-  if (log.outstanding < 1)
+  if (log.trans[log.cur].outstanding < 1)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorption
+  for (i = 0; i < lh->n; i++) {
+    if (lh->block[i] == b->blockno)   // log absorption
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  lh->block[i] = b->blockno;
+  if (i == lh->n) {  // Add new block to log?
     bpin(b);
-    log.lh.n++;
+    lh->n++;
   }
   release(&log.lock);
 }
 
+// Print group commit statistics. No locks, like statdump().
+void
+logstats(void)
+{
+  uint64 commits = log.commits ? log.commits : 1;
+
+  printf("log: %ld ops in %ld commits (%ld per commit), %ld blocks logged, %ld installed by %ld checkpoints, %d-block log\n",
+         log.ops, log.commits, log.ops / commits, log.blocks,
+         log.installed, log.checkpoints, log.size);
+}
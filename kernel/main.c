@@ -27,6 +27,8 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    pollinit();      // poll() timers
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
@@ -1,15 +1,19 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
-#define NOFILE       16  // open files per process
+#define NOFILE      256  // open files per process
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define MAXOPBLOCKS  16  // max # of blocks any FS op writes
+#define LOGSIZE      500   // max blocks in on-disk log
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
+#define BCACHEFRAC   4     // disk block cache may grow to 1/BCACHEFRAC of RAM
+#define READAHEAD    32    // max blocks read ahead of a sequential reader
+#define FSSIZE       3000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define USERSTACK    1     // user stack pages
+#define FAULTAROUND  16    // max heap pages mapped by one page fault
+#define PIPEMAX      16    // max pages in a pipe's buffer
 
@@ -7,18 +7,66 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "poll.h"
+#include "fcntl.h"
 
-#define PIPESIZE 512
+// A pipe's buffer is a ring of npage separately allocated
+// pages, npage a power of two so that byte count off always
+// lands at the same place, even when the counts wrap.
+#define PIPESIZE(pi) ((pi)->npage * PGSIZE)
+#define PIPEBUF(pi, off) \
+  ((pi)->page[(off) / PGSIZE % (pi)->npage] + (off) % PGSIZE)
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *page[PIPEMAX];
+  uint npage;     // pages in the ring
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  struct pollq pollr;  // poll()s of the read end
+  struct pollq pollw;  // poll()s of the write end
 };
 
+static struct slabcache *pipecache;
+
+// Constructor for pipecache: freed pipes keep an initialized lock.
+static void
+pipector(void *o)
+{
+  struct pipe *pi = o;
+
+  initlock(&pi->lock, "pipe");
+  pollqinit(&pi->pollr);
+  pollqinit(&pi->pollw);
+}
+
+void
+pipeinit(void)
+{
+  pipecache = slabcreate("pipe", sizeof(struct pipe), pipector);
+}
+
+// Wake processes waiting to read from pi, sleeping or in
+// poll(), after data arrives or the write end closes.
+// Caller must hold pi->lock.
+static void
+wakereaders(struct pipe *pi)
+{
+  wakeup(&pi->nread);
+  pollwake(&pi->pollr);
+}
+
+// Wake processes waiting to write to pi, after room is made
+// or the read end closes. Caller must hold pi->lock.
+static void
+wakewriters(struct pipe *pi)
+{
+  wakeup(&pi->nwrite);
+  pollwake(&pi->pollw);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,13 +76,18 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = (struct pipe*)slaballoc(pipecache)) == 0)
+    goto bad;
+  if((pi->page[0] = kalloc()) == 0){
+    slabfree(pipecache, pi);
+    pi = 0;
     goto bad;
+  }
+  pi->npage = 1;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
-  initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
   (*f0)->writable = 0;
@@ -47,7 +100,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    slabfree(pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -61,22 +114,61 @@ pipeclose(struct pipe *pi, int writable)
   acquire(&pi->lock);
   if(writable){
     pi->writeopen = 0;
-    wakeup(&pi->nread);
+    wakereaders(pi);
   } else {
     pi->readopen = 0;
-    wakeup(&pi->nwrite);
+    wakewriters(pi);
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    for(int i = 0; i < pi->npage; i++)
+      krefdec(pi->page[i]);
+    slabfree(pipecache, pi);
   } else
     release(&pi->lock);
 }
 
+// Of n bytes of the ring starting at byte count off, the
+// length of the run up to the end of off's page; the rest,
+// if any, continues at the start of the next page.
+static uint
+piperun(uint off, uint n)
+{
+  uint m = PGSIZE - off % PGSIZE;
+
+  return n < m ? n : m;
+}
+
+// Make sure the page that pi's next write starts in belongs
+// to pi alone. Pages handed out by pipegetpage() stay in the
+// ring, shared, until the writer comes round to them again,
+// always at the start of the page, and so can be swapped for
+// a fresh page instead of being copied.
+// Caller must hold pi->lock.
+static int
+pipeown(struct pipe *pi)
+{
+  char **pg = &pi->page[pi->nwrite / PGSIZE % pi->npage];
+  char *mem;
+
+  if(pi->nwrite % PGSIZE != 0 || krefget(*pg) <= 1)
+    return 0;
+  if((mem = kalloc()) == 0)
+    return -1;
+  krefdec(*pg);
+  *pg = mem;
+  return 0;
+}
+
+// Write n bytes to pi from src, a user virtual address if
+// user_src is 1, else a kernel address. If nonblock, rather
+// than sleep while pi is full, returns what was written,
+// or EWOULDBLOCK if nothing was.
 int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+pipewrite(struct pipe *pi, int user_src, uint64 src, int n, int nonblock)
 {
   int i = 0;
+  uint m;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
@@ -85,29 +177,40 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       release(&pi->lock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
+    if(pi->nwrite == pi->nread + PIPESIZE(pi)){ //DOC: pipewrite-full
+      if(nonblock){
+        if(i == 0)
+          i = EWOULDBLOCK;
+        break;
+      }
+      wakereaders(pi);
       sleep(&pi->nwrite, &pi->lock);
     } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      // copy as much of the free space as is contiguous.
+      m = PIPESIZE(pi) - (pi->nwrite - pi->nread);
+      m = piperun(pi->nwrite, m < n - i ? m : n - i);
+      if(pipeown(pi) < 0 ||
+         either_copyin(PIPEBUF(pi, pi->nwrite), user_src, src + i, m) == -1)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      pi->nwrite += m;
+      i += m;
     }
   }
-  wakeup(&pi->nread);
+  wakereaders(pi);
   release(&pi->lock);
 
   return i;
 }
 
+// Read up to n bytes from pi to dst, a user virtual address
+// if user_dst is 1, else a kernel address. If nonblock,
+// returns EWOULDBLOCK rather than sleep while pi is empty.
 int
-piperead(struct pipe *pi, uint64 addr, int n)
+piperead(struct pipe *pi, int user_dst, uint64 dst, int n, int nonblock)
 {
   int i;
+  uint m;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
@@ -115,16 +218,172 @@ piperead(struct pipe *pi, uint64 addr, int n)
       release(&pi->lock);
       return -1;
     }
+    if(nonblock){
+      release(&pi->lock);
+      return EWOULDBLOCK;
+    }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
+  for(i = 0; i < n; i += m){  //DOC: piperead-copy
     if(pi->nread == pi->nwrite)
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    // copy as much of the buffered data as is contiguous.
+    m = pi->nwrite - pi->nread;
+    m = piperun(pi->nread, m < n - i ? m : n - i);
+    if(either_copyout(user_dst, dst + i, PIPEBUF(pi, pi->nread), m) == -1)
       break;
+    pi->nread += m;
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  wakewriters(pi);  //DOC: piperead-wakeup
   release(&pi->lock);
   return i;
 }
+
+// Read the next PGSIZE bytes of pi without copying them, if
+// they fill one page of the ring: *pg is set to that page,
+// with a reference for the caller. Waits for data like
+// piperead(). Returns PGSIZE, or 0 if the data is not a
+// whole page and must be copied with piperead(), or -1.
+int
+pipegetpage(struct pipe *pi, char **pg)
+{
+  struct proc *pr = myproc();
+  int r = 0;
+
+  acquire(&pi->lock);
+  while(pi->nread == pi->nwrite && pi->writeopen){
+    if(killed(pr)){
+      release(&pi->lock);
+      return -1;
+    }
+    sleep(&pi->nread, &pi->lock);
+  }
+  if(pi->nread % PGSIZE == 0 && pi->nwrite - pi->nread >= PGSIZE){
+    *pg = pi->page[pi->nread / PGSIZE % pi->npage];
+    krefinc(*pg);
+    pi->nread += PGSIZE;
+    wakewriters(pi);
+    r = PGSIZE;
+  }
+  release(&pi->lock);
+  return r;
+}
+
+// Write the PGSIZE bytes of page pg to pi without copying
+// them, by putting pg itself in the ring, if pi's next write
+// starts a page. On success pi takes over the caller's
+// reference to pg. Waits for room like pipewrite(). Returns
+// PGSIZE, or 0 if pg must be copied with pipewrite(), or -1.
+int
+pipeputpage(struct pipe *pi, char *pg)
+{
+  struct proc *pr = myproc();
+  char **slot;
+
+  acquire(&pi->lock);
+  for(;;){
+    if(pi->readopen == 0 || killed(pr)){
+      release(&pi->lock);
+      return -1;
+    }
+    if(pi->nwrite % PGSIZE != 0){
+      release(&pi->lock);
+      return 0;
+    }
+    if(pi->nwrite + PGSIZE <= pi->nread + PIPESIZE(pi))
+      break;
+    wakereaders(pi);
+    sleep(&pi->nwrite, &pi->lock);
+  }
+  slot = &pi->page[pi->nwrite / PGSIZE % pi->npage];
+  krefdec(*slot);
+  *slot = pg;
+  pi->nwrite += PGSIZE;
+  wakereaders(pi);
+  release(&pi->lock);
+  return PGSIZE;
+}
+
+// Return the size in bytes of pi's buffer.
+int
+pipesize(struct pipe *pi)
+{
+  int n;
+
+  acquire(&pi->lock);
+  n = PIPESIZE(pi);
+  release(&pi->lock);
+  return n;
+}
+
+// Resize pi's buffer to hold at least n bytes, rounded up to a
+// power-of-two number of pages, at most PIPEMAX. Fails if the
+// bytes already buffered would not fit. Returns the new size.
+int
+pipesetsize(struct pipe *pi, int n)
+{
+  char *page[PIPEMAX], *old[PIPEMAX];
+  uint npage, nold, off, m;
+  int i;
+
+  if(n <= 0 || n > PIPEMAX * PGSIZE)
+    return -1;
+  for(npage = 1; npage * PGSIZE < n; npage *= 2)
+    ;
+  for(i = 0; i < npage; i++){
+    if((page[i] = kalloc()) == 0){
+      while(--i >= 0)
+        kfree(page[i]);
+      return -1;
+    }
+  }
+
+  acquire(&pi->lock);
+  if(pi->nwrite - pi->nread > npage * PGSIZE){
+    release(&pi->lock);
+    for(i = 0; i < npage; i++)
+      kfree(page[i]);
+    return -1;
+  }
+  // move the buffered bytes to the same counts in the new ring.
+  for(off = pi->nread; off != pi->nwrite; off += m){
+    m = piperun(off, pi->nwrite - off);
+    memmove(page[off / PGSIZE % npage] + off % PGSIZE, PIPEBUF(pi, off), m);
+  }
+  nold = pi->npage;
+  memmove(old, pi->page, nold * sizeof(old[0]));
+  memmove(pi->page, page, npage * sizeof(page[0]));
+  pi->npage = npage;
+  wakewriters(pi);
+  release(&pi->lock);
+
+  for(i = 0; i < nold; i++)
+    krefdec(old[i]);
+  return npage * PGSIZE;
+}
+
+// Report which of POLLIN, POLLOUT and POLLHUP hold for the
+// read end of pi, or the write end if writable, and put pe,
+// if not 0, on that end's poll queue.
+int
+pipepoll(struct pipe *pi, int writable, struct pollent *pe)
+{
+  int r = 0;
+
+  acquire(&pi->lock);
+  if(writable){
+    pollqadd(&pi->pollw, pe);
+    if(pi->readopen == 0)
+      r |= POLLHUP;
+    else if(pi->nwrite != pi->nread + PIPESIZE(pi))
+      r |= POLLOUT;
+  } else {
+    pollqadd(&pi->pollr, pe);
+    if(pi->nread != pi->nwrite)
+      r |= POLLIN;
+    if(pi->writeopen == 0)
+      r |= POLLHUP;
+  }
+  release(&pi->lock);
+  return r;
+}
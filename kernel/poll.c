@@ -0,0 +1,226 @@
+//
+// poll(): wait for any of a set of files to become ready.
+//
+// Every object a file can refer to has a pollq of the poll()
+// calls waiting on it: pipes one for each end, the console one
+// for input, inodes one for growth. A poll() call puts a pollent
+// on the queue of each file's object, then sleeps on its own
+// pollwait. An object that changes calls pollwake() on its
+// queue, which wakes just the processes polling that object.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "poll.h"
+
+// One poll() call.
+struct pollwait {
+  struct spinlock lock;
+  int ready;              // something polled may have changed
+  uint deadline;          // ticks at which a timed poll() gives up
+  struct pollwait *next;  // on polltimers
+};
+
+// One file of a poll() call.
+struct pollent {
+  struct pollq *q;        // queue this is on, or 0
+  struct pollwait *w;
+  struct pollent *next;   // neighbours on q
+  struct pollent *prev;
+};
+
+// Timed poll() calls, which the clock wakes at their deadlines.
+struct {
+  struct spinlock lock;
+  struct pollwait *head;
+} polltimers;
+
+extern uint ticks;
+
+void
+pollinit(void)
+{
+  initlock(&polltimers.lock, "polltimers");
+}
+
+void
+pollqinit(struct pollq *q)
+{
+  initlock(&q->lock, "pollq");
+  q->head = 0;
+}
+
+// Put pe on q, if pe is not 0 and not on a queue already.
+// Called by an object's poll function holding the lock that
+// its pollwake() calls are made under, so that a change comes
+// either before the poll function looks or after pe is on q.
+void
+pollqadd(struct pollq *q, struct pollent *pe)
+{
+  if(pe == 0 || pe->q)
+    return;
+  acquire(&q->lock);
+  pe->q = q;
+  pe->prev = 0;
+  pe->next = q->head;
+  if(q->head)
+    q->head->prev = pe;
+  q->head = pe;
+  release(&q->lock);
+}
+
+// Take pe off its queue.
+static void
+pollqdel(struct pollent *pe)
+{
+  struct pollq *q = pe->q;
+
+  if(q == 0)
+    return;
+  acquire(&q->lock);
+  if(pe->prev)
+    pe->prev->next = pe->next;
+  else
+    q->head = pe->next;
+  if(pe->next)
+    pe->next->prev = pe->prev;
+  release(&q->lock);
+  pe->q = 0;
+}
+
+static void
+pollready(struct pollwait *w)
+{
+  acquire(&w->lock);
+  w->ready = 1;
+  wakeup(w);
+  release(&w->lock);
+}
+
+// Wake the poll() calls waiting on q.
+void
+pollwake(struct pollq *q)
+{
+  struct pollent *pe;
+
+  if(q->head == 0)  // nobody polling; see pollqadd().
+    return;
+  acquire(&q->lock);
+  for(pe = q->head; pe; pe = pe->next)
+    pollready(pe->w);
+  release(&q->lock);
+}
+
+// Called by the clock on every tick.
+void
+polltick(void)
+{
+  struct pollwait *w;
+
+  if(polltimers.head == 0)
+    return;
+  acquire(&polltimers.lock);
+  for(w = polltimers.head; w; w = w->next)
+    if((int)(ticks - w->deadline) >= 0)
+      pollready(w);
+  release(&polltimers.lock);
+}
+
+static void
+polltimer(struct pollwait *w, int on)
+{
+  struct pollwait **pp;
+
+  acquire(&polltimers.lock);
+  if(on){
+    w->next = polltimers.head;
+    polltimers.head = w;
+  } else {
+    for(pp = &polltimers.head; *pp != w; pp = &(*pp)->next)
+      ;
+    *pp = w->next;
+  }
+  release(&polltimers.lock);
+}
+
+// Wait until one of the n files described by the struct
+// pollfds at user address addr is ready, or timeout ticks
+// have passed; a negative timeout waits for ever. Fills in
+// each revents and returns the number of files ready.
+int
+poll(uint64 addr, int n, int timeout)
+{
+  struct proc *p = myproc();
+  struct pollfd *fds;
+  struct pollent *pe;
+  struct file *f;
+  struct pollwait w;
+  int i, nready, fd;
+
+  fds = bd_malloc(n * sizeof(struct pollfd));
+  pe = bd_malloc(n * sizeof(struct pollent));
+  if(fds == 0 || pe == 0 ||
+     copyin(p->pagetable, (char*)fds, addr, n * sizeof(struct pollfd)) < 0){
+    nready = -1;
+    goto out;
+  }
+  memset(pe, 0, n * sizeof(struct pollent));
+  initlock(&w.lock, "pollwait");
+  w.deadline = ticks + timeout;
+  if(timeout > 0)
+    polltimer(&w, 1);
+
+  for(;;){
+    // anything that changes after this sets w.ready again.
+    acquire(&w.lock);
+    w.ready = 0;
+    release(&w.lock);
+    nready = 0;
+    for(i = 0; i < n; i++){
+      fds[i].revents = 0;
+      if((fd = fds[i].fd) < 0)
+        continue;
+      if(fd >= NOFILE || (f = p->ofile[fd]) == 0){
+        fds[i].revents = POLLNVAL;
+      } else {
+        pe[i].w = &w;
+        fds[i].revents = filepoll(f, &pe[i]) & (fds[i].events | POLLHUP);
+      }
+      if(fds[i].revents)
+        nready++;
+    }
+    if(nready || timeout == 0 || (timeout > 0 && (int)(ticks - w.deadline) >= 0))
+      break;
+
+    acquire(&w.lock);
+    while(w.ready == 0 && !killed(p))
+      sleep(&w, &w.lock);
+    release(&w.lock);
+    if(killed(p)){
+      nready = -1;
+      break;
+    }
+  }
+
+  for(i = 0; i < n; i++)
+    pollqdel(&pe[i]);
+  if(timeout > 0)
+    polltimer(&w, 0);
+  if(nready >= 0 &&
+     copyout(p->pagetable, addr, (char*)fds, n * sizeof(struct pollfd)) < 0)
+    nready = -1;
+
+ out:
+  if(fds)
+    bd_free(fds);
+  if(pe)
+    bd_free(pe);
+  return nready;
+}
@@ -0,0 +1,11 @@
+// poll() events
+#define POLLIN    0x001   // there is data to read
+#define POLLOUT   0x004   // writing will not block
+#define POLLHUP   0x010   // the other end of a pipe is closed
+#define POLLNVAL  0x020   // fd is not open
+
+struct pollfd {
+  int fd;         // file descriptor, ignored if negative
+  short events;   // events of interest
+  short revents;  // events that occurred
+};
@@ -25,7 +25,29 @@ struct proc *initproc = 0;
 
 int nextpid = 1;
 struct spinlock pid_lock;
+
+// protects the head_wrap list and nproc.
+// must be acquired before any p->lock.
 struct spinlock proc_lock;
+int nproc;
+
+// sleep()/wakeup() channels hash into these buckets, so that
+// wakeup() only looks at processes sleeping on a colliding channel.
+#define NWAITQ 64
+#define WQHASH(chan) ((((uint64)(chan)) * 0x9E3779B97F4A7C15L) >> 58)  // top 6 bits
+struct waitq waitq[NWAITQ];
+
+// wakeup() costs, for statdump(). Kept per CPU so that wakeup()
+// needs no atomic updates; statdump() sums them.
+struct {
+    uint64 calls;     // wakeup() calls
+    uint64 examined;  // processes looked at by those calls
+    uint64 listed;    // processes a whole-list scan would have looked at
+} wqstats[NCPU];
+
+// Object caches for struct proc and its list node.
+static struct slabcache *proccache;
+static struct slabcache *wrapcache;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
@@ -47,6 +69,15 @@ proc_mapstacks(pagetable_t kpgtbl)
   
 }
 
+// Constructor for proccache: freed procs keep an initialized lock.
+static void
+procctor(void *o)
+{
+    struct proc *p = o;
+
+    initlock(&p->lock, "proc");
+}
+
 // initialize the proc table.
 void
 procinit(void)
@@ -58,6 +89,14 @@ procinit(void)
     head_wrap.proc = 0;
     head_wrap.prev_wrap = &head_wrap;
     head_wrap.next_wrap = &head_wrap;
+
+    for(int i = 0; i < NCPU; i++)
+        initlock(&cpus[i].rq.lock, "runq");
+    for(int i = 0; i < NWAITQ; i++)
+        initlock(&waitq[i].lock, "waitq");
+
+    proccache = slabcreate("proc", sizeof(struct proc), procctor);
+    wrapcache = slabcreate("proc_wrapper", sizeof(struct proc_wrapper), 0);
 }
 
 // Must be called with interrupts disabled,
@@ -104,16 +143,73 @@ allocpid()
     return pid;
 }
 
-void
-wakeup_nolock(void *chan)
+// Append p to the run queue of cpu id.
+// Caller must hold p->lock and have just made p RUNNABLE.
+static void
+runqput(struct proc *p, int id)
 {
-    struct proc_wrapper *wrap;
-    for(wrap = head_wrap.next_wrap; wrap != &head_wrap; wrap = wrap->next_wrap) {
-        struct proc *p = wrap->proc;
-        if(p != myproc() && p->state == SLEEPING && p->chan == chan) {
-            p->state = RUNNABLE;
+    struct runq *rq = &cpus[id].rq;
+
+    acquire(&rq->lock);
+    p->rq_next = 0;
+    if(rq->tail)
+        rq->tail->rq_next = p;
+    else
+        rq->head = p;
+    rq->tail = p;
+    rq->n++;
+    release(&rq->lock);
+}
+
+// Remove and return the first process on rq, or 0 if it is empty.
+static struct proc*
+runqget(struct runq *rq)
+{
+    struct proc *p;
+
+    if(rq->n == 0)  // racy peek, rechecked under the lock.
+        return 0;
+
+    acquire(&rq->lock);
+    p = rq->head;
+    if(p){
+        rq->head = p->rq_next;
+        if(rq->head == 0)
+            rq->tail = 0;
+        p->rq_next = 0;
+        rq->n--;
+    }
+    release(&rq->lock);
+    return p;
+}
+
+// Take a process from the busiest other cpu's run queue,
+// so that an idle cpu does not sit in wfi while work is queued.
+static struct proc*
+runqsteal(int self)
+{
+    struct proc *p;
+    int i, victim, most;
+
+    victim = -1;
+    most = 0;
+    for(i = 0; i < NCPU; i++){
+        if(i != self && cpus[i].rq.n > most){
+            most = cpus[i].rq.n;
+            victim = i;
         }
     }
+    if(victim < 0)
+        return 0;
+    if((p = runqget(&cpus[victim].rq)) != 0)
+        return p;
+
+    // lost the race for the busiest queue; take anything.
+    for(i = 0; i < NCPU; i++){
+        if(i != self && (p = runqget(&cpus[i].rq)) != 0)
+            return p;
+    }
+    return 0;
 }
 
 // Look in the process table for an UNUSED proc.
@@ -126,69 +222,61 @@ allocproc(void)
     struct proc_wrapper *wrap;
     struct proc *p;
 
-    int active_count = 0;
-    for(wrap = head_wrap.next_wrap; wrap != &head_wrap; wrap = wrap->next_wrap) {
-        if(wrap->proc && wrap->proc->state != UNUSED)
-            active_count++;
-    }
-    if(active_count >= NPROC)
+    if (!(p = slaballoc(proccache)))
         return 0;
+    // procctor() initialized p->lock, which comes first; clear the rest.
+    memset((char*)p + sizeof(p->lock), 0, sizeof(struct proc) - sizeof(p->lock));
 
-    acquire(&proc_lock);
-
-    if (!(p = bd_malloc(sizeof(struct proc)))) {
-        release(&proc_lock);
+    if (!(wrap = slaballoc(wrapcache))) {
+        slabfree(proccache, p);
         return 0;
     }
-    memset(p, 0, sizeof(struct proc));
 
-    if (!(wrap = bd_malloc(sizeof(struct proc_wrapper)))) {
-        bd_free(p);
+    p->pid = allocpid();
+    p->state = USED;
+
+    acquire(&proc_lock);
+    if(nproc >= NPROC){
         release(&proc_lock);
+        slabfree(wrapcache, wrap);
+        slabfree(proccache, p);
         return 0;
     }
-
+    nproc++;
     wrap->proc = p;
     wrap->prev_wrap = &head_wrap;
     wrap->next_wrap = head_wrap.next_wrap;
     head_wrap.next_wrap->prev_wrap = wrap;
     head_wrap.next_wrap = wrap;
+    release(&proc_lock);
 
-    p->pid = allocpid();
-    p->state = USED;
-
-    if ((p->kstack = (uint64) kalloc()) == 0) {
-        freeproc(p);
-        bd_free(wrap);
-        release(&proc_lock);
-        return 0;
-    }
+    if ((p->kstack = (uint64) kalloc()) == 0)
+        goto bad;
 
-    if ((p->trapframe = (struct trapframe *)kalloc()) == 0) {
-        freeproc(p);
-        bd_free(wrap);
-        release(&proc_lock);
-        return 0;
-    }
+    if ((p->trapframe = (struct trapframe *)kalloc()) == 0)
+        goto bad;
 
     p->pagetable = proc_pagetable(p);
-    if(p->pagetable == 0) {
-        freeproc(p);
-        bd_free(wrap);
-        release(&proc_lock);
-        return 0;
-    }
+    if(p->pagetable == 0)
+        goto bad;
 
     memset(&p->context, 0, sizeof(p->context));
     p->context.ra = (uint64)forkret;
     p->context.sp = p->kstack + PGSIZE;
 
+    acquire(&p->lock);
     return p;
+
+ bad:
+    acquire(&proc_lock);
+    freeproc(p);
+    release(&proc_lock);
+    return 0;
 }
 
 // free a proc structure and the data hanging from it,
 // including user pages.
-// p->lock must be held.
+// proc_lock must be held, and p must not be on a run queue.
 static void
 freeproc(struct proc *p)
 {
@@ -205,12 +293,13 @@ freeproc(struct proc *p)
         if(wrap->proc == p){
             wrap->prev_wrap->next_wrap = wrap->next_wrap;
             wrap->next_wrap->prev_wrap = wrap->prev_wrap;
-            bd_free(wrap);
+            slabfree(wrapcache, wrap);
+            nproc--;
             break;
         }
     }
 
-    bd_free(p);
+    slabfree(proccache, p);
 }
 
 pagetable_t
@@ -291,8 +380,10 @@ userinit(void)
     p->cwd = namei("/");
 
     p->state = RUNNABLE;
+    p->cpu = cpuid();
+    runqput(p, p->cpu);
 
-    release(&proc_lock);
+    release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
@@ -330,6 +421,8 @@ fork(void)
 
   // Copy user memory from parent to child.
     if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+        release(&np->lock);
+        acquire(&proc_lock);
         freeproc(np);
         release(&proc_lock);
         return -1;
@@ -350,10 +443,18 @@ fork(void)
     safestrcpy(np->name, p->name, sizeof(np->name));
 
     pid = np->pid;
+
+    release(&np->lock);
+
+    acquire(&wait_lock);
     np->parent = p;
-    np->state = RUNNABLE;
+    release(&wait_lock);
 
-    release(&proc_lock);
+    acquire(&np->lock);
+    np->state = RUNNABLE;
+    np->cpu = cpuid();
+    runqput(np, np->cpu);
+    release(&np->lock);
 
     return pid;
 }
@@ -364,14 +465,20 @@ void
 reparent(struct proc *p)
 {
     struct proc_wrapper *wrap;
+    int found = 0;
 
+    acquire(&proc_lock);
     for(wrap = head_wrap.next_wrap; wrap != &head_wrap; wrap = wrap->next_wrap){
         struct proc *pp = wrap->proc;
         if(pp->parent == p){
             pp->parent = initproc;
-            wakeup_nolock(initproc);
+            found = 1;
         }
     }
+    release(&proc_lock);
+
+    if(found)
+        wakeup(initproc);
 }
 
 // Exit the current process.  Does not return.
@@ -399,13 +506,22 @@ exit(int status)
     end_op();
     p->cwd = 0;
 
-    acquire(&proc_lock);
+    acquire(&wait_lock);
+
+    // Give any children to init.
     reparent(p);
-    wakeup_nolock(p->parent);
+
+    // Parent might be sleeping in wait().
+    wakeup(p->parent);
+
+    acquire(&p->lock);
 
     p->xstate = status;
     p->state = ZOMBIE;
 
+    release(&wait_lock);
+
+  // Jump into the scheduler, never to return.
     sched();
     panic("zombie exit");
 }
@@ -420,35 +536,43 @@ wait(uint64 addr)
     int havekids, pid;
     struct proc *p = myproc();
 
-    acquire(&proc_lock);
+    acquire(&wait_lock);
 
     for(;;){
     // Scan through table looking for exited children.
         havekids = 0;
+        acquire(&proc_lock);
         for(wrap = head_wrap.next_wrap; wrap != &head_wrap; wrap = wrap->next_wrap){
             pp = wrap->proc;
             if(pp->parent == p){
+                // make sure the child isn't still in exit() or swtch().
+                acquire(&pp->lock);
                 havekids = 1;
                 if(pp->state == ZOMBIE){
                     pid = pp->pid;
                     int xstate = pp->xstate;
+                    release(&pp->lock);
                     freeproc(pp);
                     release(&proc_lock);
+                    release(&wait_lock);
                     if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
                                             sizeof(xstate)) < 0) {
                         return -1;
                     }
                     return pid;
                 }
+                release(&pp->lock);
             }
         }
+        release(&proc_lock);
 
-        if(!havekids || p->killed){
-            release(&proc_lock);
+        if(!havekids || killed(p)){
+            release(&wait_lock);
             return -1;
         }
 
-        sleep(p, &proc_lock);
+        // Wait for a child to exit.
+        sleep(p, &wait_lock);  //DOC: wait-sleep
     }
 }
 
@@ -463,12 +587,16 @@ wait(uint64 addr)
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
+//
+// Only RUNNABLE processes are ever looked at: each cpu takes
+// work from its own run queue, and an idle cpu steals from the
+// busiest other queue before waiting for an interrupt.
 void
 scheduler(void)
 {
-    struct proc_wrapper *wrap;
     struct proc *p;
     struct cpu *c = mycpu();
+    int id = cpuid();
     c->proc = 0;
 
     for(;;){
@@ -476,25 +604,26 @@ scheduler(void)
     // turned off; enable them to avoid a deadlock if all
     // processes are waiting.
         intr_on();
-        int found = 0;
-
-        for(wrap = head_wrap.next_wrap; wrap != &head_wrap; wrap = wrap->next_wrap) {
-            acquire(&proc_lock);
-            p = wrap->proc;
-            if(p->state == RUNNABLE){
-                p->state = RUNNING;
-                c->proc = p;
-                swtch(&c->context, &p->context);
-                c->proc = 0;
-                found = 1;
-            }
-            release(&proc_lock);
-        }
 
-        if(found == 0){
-            intr_on();
+        if((p = runqget(&c->rq)) == 0 && (p = runqsteal(id)) == 0){
             asm volatile("wfi");
+            continue;
+        }
+
+        acquire(&p->lock);
+        if(p->state == RUNNABLE){
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+            p->state = RUNNING;
+            p->cpu = id;
+            c->proc = p;
+            swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+            c->proc = 0;
         }
+        release(&p->lock);
     }
 }
 
@@ -511,8 +640,8 @@ sched(void)
     int intena;
     struct proc *p = myproc();
 
-    if(!holding(&proc_lock))
-        panic("sched list_lock");
+    if(!holding(&p->lock))
+        panic("sched p->lock");
     if(mycpu()->noff != 1)
         panic("sched locks");
     if(p->state == RUNNING)
@@ -530,10 +659,11 @@ void
 yield(void)
 {
     struct proc *p = myproc();
-    acquire(&proc_lock);
+    acquire(&p->lock);
     p->state = RUNNABLE;
+    runqput(p, cpuid());
     sched();
-    release(&proc_lock);
+    release(&p->lock);
 }
 
 // A fork child's very first scheduling by scheduler()
@@ -542,7 +672,9 @@ void
 forkret(void)
 {
     static int first = 1;
-    release(&proc_lock);
+
+  // Still holding p->lock from scheduler.
+    release(&myproc()->lock);
 
     if(first){
         first = 0;
@@ -553,31 +685,74 @@ forkret(void)
     usertrapret();
 }
 
+// Link p at the head of wq.
+// Caller must hold wq->lock.
+static void
+wqinsert(struct waitq *wq, struct proc *p)
+{
+    p->wq = wq;
+    p->wq_prev = 0;
+    p->wq_next = wq->head;
+    if(wq->head)
+        wq->head->wq_prev = p;
+    wq->head = p;
+}
+
+// Unlink p from the wait queue it is on.
+// Caller must hold p->wq->lock.
+static void
+wqremove(struct proc *p)
+{
+    if(p->wq_prev)
+        p->wq_prev->wq_next = p->wq_next;
+    else
+        p->wq->head = p->wq_next;
+    if(p->wq_next)
+        p->wq_next->wq_prev = p->wq_prev;
+    p->wq = 0;
+    p->wq_next = p->wq_prev = 0;
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
     struct proc *p = myproc();
-
-    if(lk != &proc_lock){
-        acquire(&proc_lock);
-        release(lk);
-    }
+    struct waitq *wq = &waitq[WQHASH(chan)];
+
+  // Must hold chan's wait queue lock and p->lock
+  // in order to join the queue, change p->state
+  // and then call sched.
+  // Once we hold the wait queue lock, we can be
+  // guaranteed that we won't miss any wakeup
+  // (wakeup locks it too),
+  // so it's okay to release lk.
+    acquire(&wq->lock);
+    acquire(&p->lock);  //DOC: sleeplock1
+    release(lk);
 
   // Go to sleep.
     p->chan = chan;
     p->state = SLEEPING;
+    wqinsert(wq, p);
+    release(&wq->lock);
 
     sched();
 
   // Tidy up.
     p->chan = 0;
+    release(&p->lock);
 
-    if(lk != &proc_lock){
-        release(&proc_lock);
-        acquire(lk);
+  // wakeup() unlinks the processes it wakes; kill() does not.
+    if(p->wq){
+        acquire(&wq->lock);
+        wqremove(p);
+        release(&wq->lock);
     }
+
+  // Reacquire original lock.
+    acquire(lk);
 }
 
 // Wake up all processes sleeping on chan.
@@ -585,9 +760,33 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-    acquire(&proc_lock);
-    wakeup_nolock(chan);
-    release(&proc_lock);
+    struct waitq *wq = &waitq[WQHASH(chan)];
+    struct proc *p, *next;
+    uint64 n = 0;
+    int id;
+
+    acquire(&wq->lock);
+    for(p = wq->head; p; p = next){
+        next = p->wq_next;
+        n++;
+        if(p->chan != chan)  // another channel in the same bucket.
+            continue;
+        acquire(&p->lock);
+        if(p->state == SLEEPING && p->chan == chan) {
+            wqremove(p);
+            p->state = RUNNABLE;
+            runqput(p, p->cpu);
+        }
+        release(&p->lock);
+    }
+    release(&wq->lock);
+
+    push_off();
+    id = cpuid();
+    wqstats[id].calls++;
+    wqstats[id].examined += n;
+    wqstats[id].listed += nproc;
+    pop_off();
 }
 // Kill the process with the given pid.
 // The victim won't exit until it tries to return
@@ -601,13 +800,19 @@ kill(int pid)
 
     for(wrap = head_wrap.next_wrap; wrap != &head_wrap; wrap = wrap->next_wrap){
         p = wrap->proc;
+        acquire(&p->lock);
         if(p->pid == pid){
             p->killed = 1;
-            if(p->state == SLEEPING)
+            if(p->state == SLEEPING){
+                // Wake process from sleep().
                 p->state = RUNNABLE;
+                runqput(p, p->cpu);
+            }
+            release(&p->lock);
             release(&proc_lock);
             return 0;
         }
+        release(&p->lock);
     }
 
     release(&proc_lock);
@@ -617,18 +822,18 @@ kill(int pid)
 void
 setkilled(struct proc *p)
 {
-    acquire(&proc_lock);
+    acquire(&p->lock);
     p->killed = 1;
-    release(&proc_lock);
+    release(&p->lock);
 }
 
 int
 killed(struct proc *p)
 {
     int k;
-    acquire(&proc_lock);
+    acquire(&p->lock);
     k = p->killed;
-    release(&proc_lock);
+    release(&p->lock);
     return k;
 }
 
@@ -690,10 +895,40 @@ procdump(void)
             state = states[p->state];
         else
             state = "???";
-        printf("%d %s %s\n", p->pid, state, p->name);
+        printf("%d %s %s faults %d pages %d\n", p->pid, state, p->name,
+               p->nfault, p->nfaultpages);
     }
 }
 
+// Print kernel statistics to console.  For debugging.
+// Runs when user types ^T on console.
+// No lock to avoid wedging a stuck machine further.
+void
+statdump(void)
+{
+    uint64 calls = 0, examined = 0, listed = 0, c;
+
+    for(int i = 0; i < NCPU; i++){
+        calls += wqstats[i].calls;
+        examined += wqstats[i].examined;
+        listed += wqstats[i].listed;
+    }
+    c = calls ? calls : 1;
+
+    printf("\n");
+    printf("wakeup: %ld calls, %ld.%ld procs examined per call (list scan %ld.%ld)\n",
+           calls,
+           examined / c, examined * 10 / c % 10,
+           listed / c, listed * 10 / c % 10);
+    bd_stats();
+    kallocstats();
+    slabstats();
+    bstats();
+    logstats();
+    dcstats();
+    virtio_disk_stats();
+}
+
 int dump(void) {
     struct proc *p = myproc();
     uint64 *regs = (uint64*)p->trapframe;
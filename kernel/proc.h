@@ -18,12 +18,29 @@ struct context {
   uint64 s11;
 };
 
+// Per-CPU queue of RUNNABLE processes.
+// A process is on at most one run queue, and only while RUNNABLE.
+struct runq {
+  struct spinlock lock;
+  struct proc *head;          // Next process to run.
+  struct proc *tail;
+  int n;                      // Number of queued processes.
+};
+
+// Processes sleeping on channels that hash to the same bucket.
+// A process is on at most one wait queue at a time.
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+};
+
 // Per-CPU state.
 struct cpu {
   struct proc *proc;          // The process running on this cpu, or null.
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  struct runq rq;             // Processes waiting to run on this cpu.
 };
 
 extern struct cpu cpus[NCPU];
@@ -91,6 +108,15 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // Cpu whose run queue p goes on when woken
+
+  // the run queue lock must be held when using this:
+  struct proc *rq_next;        // Next process on the same run queue
+
+  // the wait queue lock must be held when using these:
+  struct waitq *wq;            // Wait queue p sleeps on, or null
+  struct proc *wq_next;        // Neighbours on that wait queue
+  struct proc *wq_prev;
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
@@ -104,6 +130,10 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  uint64 lazynext;             // Page just past the last heap fault's window
+  int lazywin;                 // Pages mapped by the last heap fault
+  int nfault;                  // Heap page faults taken
+  int nfaultpages;             // Heap pages mapped by those faults
 };
 
 struct proc_wrapper {
@@ -0,0 +1,233 @@
+// Object caches for small, fixed-size kernel objects
+// (struct proc, struct file, pipes), built on kalloc().
+//
+// Each cache carves whole pages ("slabs") into equal objects.
+// A slab starts with a struct slab header and a stack of the
+// indices of its free objects; objects follow, so the slab of
+// any object is found by rounding its address down to a page.
+// Free objects are never written by the cache, so a cache's
+// constructor runs only once per object, when its slab is
+// created, and objects must be returned to the cache in that
+// constructed state.
+//
+// In front of the slabs every CPU keeps a few free objects,
+// used with interrupts off and no lock, so that most
+// slaballoc() and slabfree() calls touch no shared state.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NSLABCACHE 8   // maximum number of caches
+#define SLABCPU    8   // free objects kept per CPU per cache
+
+struct slab {
+  struct slabcache *cache;
+  struct slab *next;     // on cache's partial or full list
+  struct slab *prev;
+  int nfree;             // entries on the stack after this header
+};
+
+// the slab's stack of free object indices.
+#define SLABFREE(s) ((ushort*)((s) + 1))
+
+struct slabcache {
+  char *name;
+  uint objsize;          // size asked for by slabcreate
+  uint size;             // objsize rounded up for alignment
+  int perslab;           // objects per slab
+  uint objoff;           // offset of the first object in a slab
+  void (*ctor)(void*);
+
+  struct spinlock lock;  // protects the slab lists and nslab
+  struct slab partial;   // slabs with free objects
+  struct slab full;      // slabs with none
+  int nslab;
+
+  struct {
+    void *obj[SLABCPU];
+    int n;
+    int inuse;           // allocs minus frees on this CPU
+  } cpu[NCPU];
+};
+
+static struct slabcache caches[NSLABCACHE];
+static int ncache;
+
+static void
+slablink(struct slab *head, struct slab *s)
+{
+  s->next = head->next;
+  s->prev = head;
+  head->next->prev = s;
+  head->next = s;
+}
+
+static void
+slabunlink(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+}
+
+// Create a cache of objects of size bytes. ctor, if not 0,
+// is run on each object when its slab is allocated.
+// Only called during boot.
+struct slabcache*
+slabcreate(char *name, uint size, void (*ctor)(void*))
+{
+  struct slabcache *c;
+
+  if(ncache >= NSLABCACHE)
+    panic("slabcreate: too many caches");
+  c = &caches[ncache++];
+  c->name = name;
+  c->objsize = size;
+  c->size = (size + 7) & ~7;
+  c->perslab = (PGSIZE - sizeof(struct slab)) / (c->size + sizeof(ushort));
+  for(;;){
+    if(c->perslab < 1)
+      panic("slabcreate: object too big");
+    c->objoff = (sizeof(struct slab) + c->perslab * sizeof(ushort) + 7) & ~7;
+    if(c->objoff + c->perslab * c->size <= PGSIZE)
+      break;
+    c->perslab--;
+  }
+  c->ctor = ctor;
+  initlock(&c->lock, "slab");
+  c->partial.next = c->partial.prev = &c->partial;
+  c->full.next = c->full.prev = &c->full;
+  return c;
+}
+
+// Allocate a slab page for c and construct its objects.
+// Caller must hold c->lock.
+static struct slab*
+slabgrow(struct slabcache *c)
+{
+  struct slab *s;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->nfree = c->perslab;
+  for(int i = 0; i < c->perslab; i++){
+    SLABFREE(s)[i] = c->perslab - 1 - i;
+    if(c->ctor)
+      c->ctor((char*)s + c->objoff + i * c->size);
+  }
+  slablink(&c->partial, s);
+  c->nslab++;
+  return s;
+}
+
+// Move up to n free objects from c's slabs into objs.
+// Returns the number moved.
+static int
+slabtake(struct slabcache *c, void **objs, int n)
+{
+  struct slab *s;
+  int i;
+
+  acquire(&c->lock);
+  for(i = 0; i < n; i++){
+    s = c->partial.next;
+    if(s == &c->partial && (s = slabgrow(c)) == 0)
+      break;
+    objs[i] = (char*)s + c->objoff + SLABFREE(s)[--s->nfree] * c->size;
+    if(s->nfree == 0){
+      slabunlink(s);
+      slablink(&c->full, s);
+    }
+  }
+  release(&c->lock);
+  return i;
+}
+
+// Return n objects to their slabs, freeing slabs that
+// become empty.
+static void
+slabgive(struct slabcache *c, void **objs, int n)
+{
+  struct slab *s;
+
+  acquire(&c->lock);
+  for(int i = 0; i < n; i++){
+    s = (struct slab*)PGROUNDDOWN((uint64)objs[i]);
+    if(s->cache != c)
+      panic("slabfree: wrong cache");
+    if(s->nfree == 0){
+      slabunlink(s);
+      slablink(&c->partial, s);
+    }
+    SLABFREE(s)[s->nfree++] = ((char*)objs[i] - (char*)s - c->objoff) / c->size;
+    if(s->nfree == c->perslab){
+      slabunlink(s);
+      c->nslab--;
+      kfree(s);
+    }
+  }
+  release(&c->lock);
+}
+
+// Allocate an object from c, in its constructed state.
+// Returns 0 if memory is exhausted.
+void*
+slaballoc(struct slabcache *c)
+{
+  void *o = 0;
+  int id;
+
+  push_off();
+  id = cpuid();
+  if(c->cpu[id].n == 0)
+    c->cpu[id].n = slabtake(c, c->cpu[id].obj, SLABCPU / 2);
+  if(c->cpu[id].n > 0){
+    o = c->cpu[id].obj[--c->cpu[id].n];
+    c->cpu[id].inuse++;
+  }
+  pop_off();
+  return o;
+}
+
+// Return object o, in its constructed state, to c.
+void
+slabfree(struct slabcache *c, void *o)
+{
+  int id;
+
+  push_off();
+  id = cpuid();
+  if(c->cpu[id].n == SLABCPU){
+    slabgive(c, c->cpu[id].obj + SLABCPU / 2, SLABCPU / 2);
+    c->cpu[id].n = SLABCPU / 2;
+  }
+  c->cpu[id].obj[c->cpu[id].n++] = o;
+  c->cpu[id].inuse--;
+  pop_off();
+}
+
+// Print each cache's utilization (objects in use out of
+// objects in its slabs) and internal fragmentation (bytes
+// of each slab page that hold no requested object bytes).
+// No locks, like statdump().
+void
+slabstats(void)
+{
+  struct slabcache *c;
+  int inuse, total, waste;
+
+  for(c = caches; c < &caches[ncache]; c++){
+    inuse = 0;
+    for(int i = 0; i < NCPU; i++)
+      inuse += c->cpu[i].inuse;
+    total = c->nslab * c->perslab;
+    waste = PGSIZE - c->perslab * c->objsize;
+    printf("slab %s: %d/%d objects used (%d%%), %d slabs, %d of %d bytes per slab wasted\n",
+           c->name, inuse, total, total ? inuse * 100 / total : 0,
+           c->nslab, waste, PGSIZE);
+  }
+}
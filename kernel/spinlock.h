@@ -5,5 +5,6 @@ struct spinlock {
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+  uint ncontend;     // acquire() calls that found it held
 };
 
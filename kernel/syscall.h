@@ -21,4 +21,8 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_dump   22
-#define SYS_dump2  23
\ No newline at end of file
+#define SYS_dump2  23
+#define SYS_fcntl  24
+#define SYS_splice 25
+#define SYS_poll   26
+#define SYS_pipe2  27
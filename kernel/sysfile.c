@@ -94,6 +94,45 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
+uint64
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  argint(2, &n);
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0)
+    return -1;
+  return filesplice(in, out, n);
+}
+
+uint64
+sys_poll(void)
+{
+  uint64 fds; // user pointer to array of struct pollfd
+  int nfds, timeout;
+
+  argaddr(0, &fds);
+  argint(1, &nfds);
+  argint(2, &timeout);
+  if(nfds < 0 || nfds > NOFILE)
+    return -1;
+  return poll(fds, nfds, timeout);
+}
+
+uint64
+sys_fcntl(void)
+{
+  struct file *f;
+  int cmd, arg;
+
+  argint(1, &cmd);
+  argint(2, &arg);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filefcntl(f, cmd, arg);
+}
+
 uint64
 sys_close(void)
 {
@@ -176,6 +215,8 @@ isdirempty(struct inode *dp)
   int off;
   struct dirent de;
 
+  if(dp->major == DIRHASH)
+    return hdirsize(dp) == 2;
   for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("isdirempty: readi");
@@ -189,7 +230,6 @@ uint64
 sys_unlink(void)
 {
   struct inode *ip, *dp;
-  struct dirent de;
   char name[DIRSIZ], path[MAXPATH];
   uint off;
 
@@ -219,9 +259,7 @@ sys_unlink(void)
     goto bad;
   }
 
-  memset(&de, 0, sizeof(de));
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-    panic("unlink: writei");
+  dirunlink(dp, name, off);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -328,7 +366,7 @@ sys_open(void)
       return -1;
     }
     ilock(ip);
-    if(ip->type == T_DIR && omode != O_RDONLY){
+    if(ip->type == T_DIR && (omode & ~O_NONBLOCK) != O_RDONLY){
       iunlockput(ip);
       end_op();
       return -1;
@@ -359,6 +397,7 @@ sys_open(void)
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  f->flags = omode & O_NONBLOCK;
 
   if((omode & O_TRUNC) && ip->type == T_FILE){
     itrunc(ip);
@@ -474,17 +513,20 @@ sys_exec(void)
   return -1;
 }
 
-uint64
-sys_pipe(void)
+// Create a pipe, with status flags flags on both ends, and
+// store its read and write fds in the user array fdarray.
+static int
+makepipe(uint64 fdarray, int flags)
 {
-  uint64 fdarray; // user pointer to array of two integers
   struct file *rf, *wf;
   int fd0, fd1;
   struct proc *p = myproc();
 
-  argaddr(0, &fdarray);
+  if(flags & ~O_NONBLOCK)
+    return -1;
   if(pipealloc(&rf, &wf) < 0)
     return -1;
+  rf->flags = wf->flags = flags;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
@@ -503,3 +545,23 @@ sys_pipe(void)
   }
   return 0;
 }
+
+uint64
+sys_pipe(void)
+{
+  uint64 fdarray; // user pointer to array of two integers
+
+  argaddr(0, &fdarray);
+  return makepipe(fdarray, 0);
+}
+
+uint64
+sys_pipe2(void)
+{
+  uint64 fdarray; // user pointer to array of two integers
+  int flags;
+
+  argaddr(0, &fdarray);
+  argint(1, &flags);
+  return makepipe(fdarray, flags);
+}
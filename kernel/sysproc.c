@@ -44,6 +44,9 @@ sys_sbrk(void)
   argint(0, &n);
   addr = myproc()->sz;
   if (n > 0) {
+    // pages are allocated by the first touch; see lazyfault().
+    if(addr + n > TRAPFRAME)
+      return -1;
     myproc()->sz += n;
   } else {
     myproc()->sz = uvmdealloc(myproc()->pagetable, addr, addr + n);
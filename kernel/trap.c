@@ -29,6 +29,30 @@ trapinithart(void)
   w_stvec((uint64)kernelvec);
 }
 
+// Map the never-touched heap page at va for p.
+// A fault on the page just past the previous fault's window
+// looks like a sequential sweep, so the window doubles, up to
+// FAULTAROUND pages; any other fault maps only its own page,
+// which keeps sparse heaps from pulling in unused memory.
+static int
+lazyfault(struct proc *p, uint64 va)
+{
+  int n;
+
+  va = PGROUNDDOWN(va);
+  if(va != p->lazynext || p->lazywin == 0)
+    p->lazywin = 1;
+  else if(p->lazywin < FAULTAROUND)
+    p->lazywin = p->lazywin * 2 < FAULTAROUND ? p->lazywin * 2 : FAULTAROUND;
+
+  if((n = lazyalloc(p->pagetable, va, p->sz, p->lazywin)) < 0)
+    return -1;
+  p->lazynext = va + n * PGSIZE;
+  p->nfault++;
+  p->nfaultpages += n;
+  return 0;
+}
+
 //
 // handle an interrupt, exception, or system call from user space.
 // called from trampoline.S
@@ -81,7 +105,7 @@ usertrap(void)
               }
           }
           else if(pte == 0 || (*pte & PTE_V) == 0) {
-              if(lazyalloc(p->pagetable, fault_va, p->sz) == 0) {
+              if(lazyfault(p, fault_va) == 0) {
                   handled = 1;
               }
           }
@@ -203,6 +227,7 @@ clockintr()
     ticks++;
     wakeup(&ticks);
     release(&tickslock);
+    polltick();
   }
 
   // ask for the next timer interrupt. this also clears
@@ -47,7 +47,8 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+#define NUM 64
+#define MAXSEG 32  // most data descriptors in one request
 
 // a single descriptor, from the spec.
 struct virtq_desc {
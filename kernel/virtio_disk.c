@@ -40,14 +40,17 @@ static struct disk {
 
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
+  int nfree;       // how many are
   uint16 used_idx; // we've looked this far in used[2..NUM].
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
-  // indexed by first descriptor index of chain.
+  // status and done are indexed by first descriptor index of
+  // chain, b by the index of the descriptor for b's data.
   struct {
     struct buf *b;
     char status;
+    void (*done)(struct buf*);  // if set, call on completion; no one waits
   } info[NUM];
 
   // disk command headers.
@@ -55,6 +58,12 @@ static struct disk {
   struct virtio_blk_req ops[NUM];
   
   struct spinlock vdisk_lock;
+
+  // statistics
+  uint64 requests;     // requests queued
+  uint64 blocks;       // blocks they moved
+  uint64 completions;  // requests completed
+  uint64 intrs;
   
 } disk;
 
@@ -144,6 +153,7 @@ virtio_disk_init(void)
   // all NUM descriptors start out unused.
   for(int i = 0; i < NUM; i++)
     disk.free[i] = 1;
+  disk.nfree = NUM;
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
@@ -159,6 +169,7 @@ alloc_desc()
   for(int i = 0; i < NUM; i++){
     if(disk.free[i]){
       disk.free[i] = 0;
+      disk.nfree--;
       return i;
     }
   }
@@ -178,7 +189,7 @@ free_desc(int i)
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  disk.nfree++;
 }
 
 // free a chain of descriptors.
@@ -196,12 +207,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +222,26 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// Queue one request to read or write the n bufs in bs, which
+// hold consecutive disk blocks, without telling the device.
+// Caller must hold vdisk_lock and have checked that n+2
+// descriptors are free.
+static void
+virtio_disk_queue(struct buf **bs, int n, int write, void (*done)(struct buf*))
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
+  uint64 sector = bs[0]->blockno * (BSIZE / 512);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // a descriptor for type/reserved/sector, descriptors for the
+  // data, and one for a 1-byte status result. each buf gets its
+  // own data descriptor, so the device scatters or gathers the
+  // blocks of a run in a single request.
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
+  int idx[2+MAXSEG];
+  if(alloc_descs(idx, n+2) != 0)
+    panic("virtio_disk_queue");
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,24 +258,32 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 0; i < n; i++){
+    int d = idx[1+i];
+    disk.desc[d].addr = (uint64) bs[i]->data;
+    disk.desc[d].len = BSIZE;
+    if(write)
+      disk.desc[d].flags = 0; // device reads b->data
+    else
+      disk.desc[d].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[d].flags |= VRING_DESC_F_NEXT;
+    disk.desc[d].next = idx[2+i];
+
+    // record struct buf for virtio_disk_intr().
+    bs[i]->disk = 1;
+    disk.info[d].b = bs[i];
+  }
 
+  int st = idx[1+n];
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.desc[st].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[st].len = 1;
+  disk.desc[st].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[st].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.info[idx[0]].done = done;
+  disk.requests++;
+  disk.blocks += n;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -275,25 +292,76 @@ virtio_disk_rw(struct buf *b, int write)
 
   // tell the device another avail ring entry is available.
   disk.avail->idx += 1; // not % NUM ...
+}
 
+// Tell the device about newly queued requests.
+static void
+virtio_disk_notify(void)
+{
   __sync_synchronize();
-
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
+
+// Start reading or writing the n bufs in bs and return without
+// waiting for them; the device is told once about all of them,
+// and runs of bufs that are next to each other in bs and on disk
+// go to the device as single requests.
+// Each buf serves as the token for its own completion: if done
+// is 0, wait for it with virtio_disk_wait(); otherwise
+// virtio_disk_intr() calls done(b) when b's request finishes,
+// and done must not sleep.
+// Sleeps only if the ring is full.
+void
+virtio_disk_start(struct buf **bs, int n, int write, void (*done)(struct buf*))
+{
+  int queued = 0;
+  int i, run;
 
-  // Wait for virtio_disk_intr() to say request has finished.
+  acquire(&disk.vdisk_lock);
+  for(i = 0; i < n; i += run){
+    for(run = 1; i+run < n && run < MAXSEG; run++){
+      if(bs[i+run]->dev != bs[i]->dev || bs[i+run]->blockno != bs[i]->blockno + run)
+        break;
+    }
+    while(disk.nfree < run+2){
+      // let the device drain what we have queued so far.
+      if(queued){
+        virtio_disk_notify();
+        queued = 0;
+      }
+      sleep(&disk.free[0], &disk.vdisk_lock);
+    }
+    virtio_disk_queue(bs+i, run, write, done);
+    queued++;
+  }
+  if(queued)
+    virtio_disk_notify();
+  release(&disk.vdisk_lock);
+}
+
+// Wait for the request started for b to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
-
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(&b, 1, write, 0);
+  virtio_disk_wait(b);
+}
+
 void
 virtio_disk_intr()
 {
+  int n = 0;
+
   acquire(&disk.vdisk_lock);
 
   // the device won't raise another interrupt until we tell it
@@ -307,7 +375,9 @@ virtio_disk_intr()
   __sync_synchronize();
 
   // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
+  // adds an entry to the used ring. complete everything
+  // it has finished, then wake up submitters waiting for
+  // descriptors just once.
 
   while(disk.used_idx != disk.used->idx){
     __sync_synchronize();
@@ -316,12 +386,36 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    // complete the buf of each data descriptor in the chain.
+    void (*done)(struct buf*) = disk.info[id].done;
+    disk.info[id].done = 0;
+    for(int d = disk.desc[id].next; disk.desc[d].flags & VRING_DESC_F_NEXT; d = disk.desc[d].next){
+      struct buf *b = disk.info[d].b;
+      disk.info[d].b = 0;
+      b->disk = 0;   // disk is done with buf
+      if(done)
+        done(b);
+      else
+        wakeup(b);
+    }
+    free_chain(id);
+    n++;
 
     disk.used_idx += 1;
   }
 
+  if(n > 0)
+    wakeup(&disk.free[0]);
+  disk.completions += n;
+  disk.intrs++;
+
   release(&disk.vdisk_lock);
 }
+
+// Print driver statistics. No lock, like statdump().
+void
+virtio_disk_stats(void)
+{
+  printf("virtio: %ld requests for %ld blocks, %ld completed in %ld interrupts\n",
+         disk.requests, disk.blocks, disk.completions, disk.intrs);
+}
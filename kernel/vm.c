@@ -5,6 +5,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -15,6 +17,8 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+static int lazytouch(pagetable_t, uint64);
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -115,6 +119,8 @@ walkaddr(pagetable_t pagetable, uint64 va)
     return 0;
 
   pte = walk(pagetable, va, 0);
+  if((pte == 0 || (*pte & PTE_V) == 0) && lazytouch(pagetable, va) == 0)
+    pte = walk(pagetable, va, 0);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
@@ -173,7 +179,8 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 
 // Remove npages of mappings starting from va. va must be
 // page-aligned. The mappings must exist.
-// Optionally free the physical memory.
+// Optionally drop a reference to the physical memory,
+// freeing it once no page table maps it.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
@@ -184,15 +191,16 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+    // heap pages that were never touched have no mapping.
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
       uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+      krefdec((void*)pa);
     }
     *pte = 0;
   }
@@ -303,10 +311,12 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory with a child's page table.
+// Copies the page table but not the physical
+// memory: writable pages become read-only and
+// copy-on-write in both page tables, and are
+// copied by copy_on_write() on the first store.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
@@ -315,22 +325,20 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
   for(i = 0; i < sz; i += PGSIZE){
+    // untouched heap pages stay lazy in the child too.
     if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_RSW0;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    krefinc((void*)pa);
   }
   return 0;
 
@@ -339,6 +347,42 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   return -1;
 }
 
+// Resolve a store to the copy-on-write page at va.
+// The last owner of a page just gets write access back;
+// otherwise the page is copied and the shared one
+// loses a reference.
+// Returns 0 on success, -1 if va is not a copy-on-write
+// page or there is no memory for the copy.
+int
+copy_on_write(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
+     (*pte & PTE_RSW0) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_RSW0;
+
+  if(krefget((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  krefdec((void*)pa);
+  return 0;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -352,6 +396,50 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Map zeroed pages for the untouched heap of a process of size sz,
+// starting with the page containing va. Maps up to npages pages,
+// stopping early at sz, at a page that is already mapped, or when
+// memory runs out, so only the first page is guaranteed.
+// Returns the number of pages mapped, or -1 if even the
+// first page could not be.
+int
+lazyalloc(pagetable_t pagetable, uint64 va, uint64 sz, int npages)
+{
+  uint64 a;
+  pte_t *pte;
+  char *mem;
+  int n;
+
+  va = PGROUNDDOWN(va);
+  for(n = 0, a = va; n < npages && a < sz && a < MAXVA; n++, a += PGSIZE){
+    if((pte = walk(pagetable, a, 1)) == 0 || (*pte & PTE_V))
+      break;
+    if((mem = kalloc()) == 0)
+      break;
+    memset(mem, 0, PGSIZE);
+    *pte = PA2PTE(mem) | PTE_R | PTE_W | PTE_U | PTE_V;
+  }
+  return n > 0 ? n : -1;
+}
+
+// The kernel is about to touch user address va, which has no
+// mapping. If it lies in the current process's heap, allocate
+// the page now, as a page fault would have.
+// Returns 0 if the page is now mapped.
+static int
+lazytouch(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || pagetable != p->pagetable || va >= p->sz)
+    return -1;
+  if(lazyalloc(pagetable, va, p->sz, 1) < 0)
+    return -1;
+  p->nfault++;
+  p->nfaultpages++;
+  return 0;
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -366,6 +454,10 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
     if(va0 >= MAXVA)
       return -1;
     pte = walk(pagetable, va0, 0);
+    if((pte == 0 || (*pte & PTE_V) == 0) && lazytouch(pagetable, va0) == 0)
+      pte = walk(pagetable, va0, 0);
+    if(pte != 0 && (*pte & PTE_RSW0) && copy_on_write(pagetable, va0) != 0)
+      return -1;
     if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
        (*pte & PTE_W) == 0)
       return -1;
@@ -15,7 +15,7 @@
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
-#define NINODES 200
+#define NINODES 1000
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
@@ -26,6 +26,8 @@ int nlog = LOGSIZE;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
+int nhash;    // buckets in a hashed root directory; 0 for linear
+
 int fsfd;
 struct superblock sb;
 char zeroes[BSIZE];
@@ -40,6 +42,8 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+uint fbaddr(struct dinode *din, uint fbn);
+void dappend(uint dir, char *name, uint inum);
 void die(const char *);
 
 // convert to riscv byte order
@@ -70,15 +74,19 @@ main(int argc, char *argv[])
 {
   int i, cc, fd;
   uint rootino, inum, off;
-  struct dirent de;
   char buf[BSIZE];
   struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if(argc > 2 && strcmp(argv[1], "-h") == 0){
+    nhash = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-h buckets] fs.img files...\n");
     exit(1);
   }
 
@@ -117,15 +125,19 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
+  if(nhash > 0){
+    // a hashed root: nhash empty buckets.
+    rinode(rootino, &din);
+    din.major = xshort(DIRHASH);
+    din.minor = xshort(nhash);
+    winode(rootino, &din);
+    bzero(buf, sizeof(buf));
+    for(i = 0; i < nhash; i++)
+      iappend(rootino, buf, BSIZE);
+  }
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  dappend(rootino, ".", rootino);
+  dappend(rootino, "..", rootino);
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -150,11 +162,7 @@ main(int argc, char *argv[])
     assert(strlen(shortname) <= DIRSIZ);
     
     inum = ialloc(T_FILE);
-
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    dappend(rootino, shortname, inum);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -165,7 +173,8 @@ main(int argc, char *argv[])
   // fix size of root inode dir
   rinode(rootino, &din);
   off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
+  if(off % BSIZE)
+    off = ((off/BSIZE) + 1) * BSIZE;
   din.size = xint(off);
   winode(rootino, &din);
 
@@ -251,6 +260,41 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Disk address of block fbn of the file with inode din,
+// allocating it, and indirect blocks on the way, if needed.
+uint
+fbaddr(struct dinode *din, uint fbn)
+{
+  uint indirect[NINDIRECT];
+  uint x, span, idx, bn;
+  int level, l;
+
+  assert(fbn < MAXFILE);
+  if(fbn < NDIRECT){
+    if(xint(din->addrs[fbn]) == 0)
+      din->addrs[fbn] = xint(freeblock++);
+    return xint(din->addrs[fbn]);
+  }
+
+  bn = fbn - NDIRECT;
+  for(level = 1, span = NINDIRECT; bn >= span; level++, span *= NINDIRECT)
+    bn -= span;
+  if(xint(din->addrs[NDIRECT+level-1]) == 0)
+    din->addrs[NDIRECT+level-1] = xint(freeblock++);
+  x = xint(din->addrs[NDIRECT+level-1]);
+  for(l = level, span /= NINDIRECT; l > 0; l--, span /= NINDIRECT){
+    rsect(x, (char*)indirect);
+    idx = bn / span;
+    bn %= span;
+    if(indirect[idx] == 0){
+      indirect[idx] = xint(freeblock++);
+      wsect(x, (char*)indirect);
+    }
+    x = xint(indirect[idx]);
+  }
+  return x;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -258,7 +302,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -266,23 +309,7 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = fbaddr(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -295,6 +322,66 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+// Add the entry (name, inum) to directory dir, in its
+// bucket if dir is hashed (see kernel/fs.h).
+void
+dappend(uint dir, char *name, uint inum)
+{
+  struct dinode din;
+  struct dirent de[DPB];
+  struct dirhdr *hd;
+  uint nb, h, b, x;
+  int k, i;
+
+  bzero(de, sizeof(struct dirent));
+  de[0].inum = xshort(inum);
+  strncpy(de[0].name, name, DIRSIZ);
+  rinode(dir, &din);
+  if(xshort(din.major) != DIRHASH){
+    iappend(dir, de, sizeof(struct dirent));
+    return;
+  }
+
+  nb = xshort(din.minor);
+  h = dirhash(name) % nb;
+  for(k = 0; k < DIRPROBE; k++){
+    b = (h + k) % nb;
+    rsect(fbaddr(&din, b), (char*)de);
+    if(xshort(((struct dirhdr*)de)->nent) < DPB - 1)
+      break;
+  }
+  hd = (struct dirhdr*)de;
+  if(k == DIRPROBE){
+    // buckets full: append to the overflow blocks.
+    bzero(de, sizeof(struct dirent));
+    de[0].inum = xshort(inum);
+    strncpy(de[0].name, name, DIRSIZ);
+    iappend(dir, de, sizeof(struct dirent));
+    rinode(dir, &din);
+    x = fbaddr(&din, h);
+    rsect(x, (char*)de);
+    hd->spill = xshort(xshort(hd->spill) + 1);
+    wsect(x, (char*)de);
+  } else {
+    for(i = 1; de[i].inum != 0; i++)
+      ;
+    de[i].inum = xshort(inum);
+    strncpy(de[i].name, name, DIRSIZ);
+    hd->nent = xshort(xshort(hd->nent) + 1);
+    wsect(fbaddr(&din, b), (char*)de);
+    if(k > 0){
+      x = fbaddr(&din, h);
+      rsect(x, (char*)de);
+      hd->over = xshort(xshort(hd->over) + 1);
+      wsect(x, (char*)de);
+    }
+  }
+  x = fbaddr(&din, 0);
+  rsect(x, (char*)de);
+  hd->total = xint(xint(hd->total) + 1);
+  wsect(x, (char*)de);
+}
+
 void
 die(const char *s)
 {
@@ -0,0 +1,94 @@
+// Time file creation as the inodes of the file system fill up.
+//
+// First creates files in batches, each in its own directory so
+// that directory searches stay short, until the disk runs out of
+// inodes, printing the ticks each batch took. Then, on the full
+// disk, repeatedly removes and re-creates the last file, whose
+// inode is the only free one. Both should take the same time per
+// file however many inodes are in use.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define BATCH  50     // files per directory
+#define ROUNDS 1000   // re-creations on the full disk
+
+char name[32];
+
+// name of file i of batch b.
+char*
+fname(int b, int i)
+{
+  char *p = name;
+
+  *p++ = 'c';
+  *p++ = 'b';
+  *p++ = '0' + b / 10;
+  *p++ = '0' + b % 10;
+  if(i >= 0){
+    *p++ = '/';
+    *p++ = '0' + i / 10;
+    *p++ = '0' + i % 10;
+  }
+  *p = 0;
+  return name;
+}
+
+int
+create(char *path)
+{
+  int fd;
+
+  if((fd = open(path, O_CREATE | O_RDWR)) < 0)
+    return -1;
+  close(fd);
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int b, i, n, t0, lastb, lasti;
+
+  printf("createbench: filling inodes, %d files per batch\n", BATCH);
+  n = 0;
+  lastb = lasti = -1;
+  for(b = 0; b < 100 && mkdir(fname(b, -1)) == 0; b++){
+    t0 = uptime();
+    for(i = 0; i < BATCH && create(fname(b, i)) == 0; i++){
+      lastb = b;
+      lasti = i;
+    }
+    n += i;
+    printf("batch %d: %d files in %d ticks, %d files total\n",
+           b, i, uptime() - t0, n);
+    if(i < BATCH){
+      b++;
+      break;
+    }
+  }
+  if(b == 100 || lastb < 0){
+    printf("createbench: inodes did not run out\n");
+  } else {
+    // the last file created holds the only free inode.
+    t0 = uptime();
+    for(int r = 0; r < ROUNDS; r++){
+      if(unlink(fname(lastb, lasti)) < 0 || create(fname(lastb, lasti)) < 0){
+        printf("createbench: re-creating %s failed\n", fname(lastb, lasti));
+        exit(1);
+      }
+    }
+    printf("full disk: %d re-creations in %d ticks\n", ROUNDS, uptime() - t0);
+  }
+
+  // clean up.
+  while(--b >= 0){
+    for(i = 0; i < BATCH; i++)
+      unlink(fname(b, i));
+    unlink(fname(b, -1));
+  }
+  printf("createbench: done\n");
+  exit(0);
+}
@@ -0,0 +1,90 @@
+// Measure pipe throughput.
+//
+// For each write size, a child writes MB megabytes into a pipe
+// and the parent reads them back with reads of the same size,
+// printing the rate in MB/s. Ticks are a tenth of a second, so
+// runs should be long enough to take several of them. If a
+// pipe size is given, each pipe's buffer is resized to it.
+//
+// usage: pipebench [megabytes [pipesize]]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define MB      (1024*1024)
+#define TICKHZ  10      // timer interrupts per second
+
+int sizes[] = { 64, 512, 4096, 16384 };
+char buf[16384];
+int psz;         // pipe buffer size, 0 for the default
+
+// copy mb megabytes through a pipe in chunks of bs bytes.
+// returns the ticks it took, or -1.
+int
+run(int mb, int bs)
+{
+  int fds[2], pid, n, t0, st;
+  long total, got;
+
+  total = (long)mb * MB;
+  if(pipe(fds) < 0){
+    fprintf(2, "pipebench: pipe failed\n");
+    return -1;
+  }
+  if(psz > 0 && fcntl(fds[0], F_SETPIPE_SZ, psz) < 0){
+    fprintf(2, "pipebench: cannot resize pipe to %d\n", psz);
+    return -1;
+  }
+  t0 = uptime();
+  if((pid = fork()) < 0){
+    fprintf(2, "pipebench: fork failed\n");
+    return -1;
+  }
+  if(pid == 0){
+    close(fds[0]);
+    for(got = 0; got < total; got += bs){
+      if(write(fds[1], buf, bs) != bs){
+        fprintf(2, "pipebench: write failed\n");
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  close(fds[1]);
+  got = 0;
+  while((n = read(fds[0], buf, bs)) > 0)
+    got += n;
+  close(fds[0]);
+  wait(&st);
+  if(got != total || st != 0){
+    fprintf(2, "pipebench: read %ld of %ld bytes\n", got, total);
+    return -1;
+  }
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int mb, t, rate;
+
+  mb = argc > 1 ? atoi(argv[1]) : 16;
+  psz = argc > 2 ? atoi(argv[2]) : 0;
+  if(mb <= 0){
+    fprintf(2, "usage: pipebench [megabytes [pipesize]]\n");
+    exit(1);
+  }
+  for(int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+    if((t = run(mb, sizes[i])) < 0)
+      exit(1);
+    if(t == 0)
+      t = 1;
+    // tenths of a MB/s.
+    rate = mb * TICKHZ * 10 / t;
+    printf("%d byte chunks: %d MB in %d ticks, %d.%d MB/s\n",
+           sizes[i], mb, t, rate / 10, rate % 10);
+  }
+  exit(0);
+}
@@ -12,6 +12,7 @@
 #define BACK  5
 
 #define MAXARGS 10
+#define PIPESZ  (8*4096)  // buffer size of pipes between commands
 
 struct cmd {
   int type;
@@ -102,6 +103,7 @@ runcmd(struct cmd *cmd)
     pcmd = (struct pipecmd*)cmd;
     if(pipe(p) < 0)
       panic("pipe");
+    fcntl(p[0], F_SETPIPE_SZ, PIPESZ);  // best effort
     if(fork1() == 0){
       close(1);
       dup(p[1]);
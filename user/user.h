@@ -1,4 +1,5 @@
 struct stat;
+struct pollfd;
 
 // system calls
 int fork(void);
@@ -24,6 +25,10 @@ int sleep(int);
 int uptime(void);
 int dump(void);
 int dump2(int pid, int register_num, uint64* return_value);
+int fcntl(int, int, int);
+int splice(int, int, int);
+int poll(struct pollfd*, int, int);
+int pipe2(int*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -4,6 +4,7 @@
 #include "user/user.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
+#include "kernel/poll.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
@@ -578,6 +579,10 @@ writetest(char *s)
   }
 }
 
+// a file reaching into the double-indirect blocks; MAXFILE
+// is more than the disk holds.
+#define BIGFILE (NDIRECT + NINDIRECT + 2*NINDIRECT)
+
 void
 writebig(char *s)
 {
@@ -589,7 +594,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGFILE; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed i=%d\n", s, i);
@@ -609,7 +614,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n != MAXFILE){
+      if(n != BIGFILE){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -788,6 +793,300 @@ pipe1(char *s)
   }
 }
 
+// write n bytes of a pattern to a pipe, continuing from byte *pos.
+void
+pswrite(char *s, int fd, int n, int *pos)
+{
+  for(int i = 0; i < n; i++)
+    buf[i] = *pos + i;
+  if(write(fd, buf, n) != n){
+    printf("%s: write %d bytes at %d failed\n", s, n, *pos);
+    exit(1);
+  }
+  *pos += n;
+}
+
+// read n bytes from a pipe and check them against pswrite()'s pattern.
+void
+psread(char *s, int fd, int n, int *pos)
+{
+  if(read(fd, buf, n) != n){
+    printf("%s: read %d bytes at %d failed\n", s, n, *pos);
+    exit(1);
+  }
+  for(int i = 0; i < n; i++){
+    if((buf[i] & 0xff) != ((*pos + i) & 0xff)){
+      printf("%s: wrong data at %d\n", s, *pos + i);
+      exit(1);
+    }
+  }
+  *pos += n;
+}
+
+// grow a pipe's buffer, fill it with no reader, and
+// check that it cannot shrink below what it holds. then
+// resize it while what it holds wraps around the ring or
+// straddles a page, and check the bytes survive.
+void
+pipesize(char *s)
+{
+  int fds[2], i, n, w, r;
+  enum { SZ=1024 };
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[0], F_GETPIPE_SZ, 0) != PGSIZE){
+    printf("%s: default pipe size %d\n", s, fcntl(fds[0], F_GETPIPE_SZ, 0));
+    exit(1);
+  }
+  if((n = fcntl(fds[1], F_SETPIPE_SZ, 3*PGSIZE)) != 4*PGSIZE){
+    printf("%s: F_SETPIPE_SZ returned %d\n", s, n);
+    exit(1);
+  }
+  for(n = 0; n < 4*PGSIZE; n += SZ){
+    for(i = 0; i < SZ; i++)
+      buf[i] = n + i;
+    if(write(fds[1], buf, SZ) != SZ){
+      printf("%s: write to grown pipe failed\n", s);
+      exit(1);
+    }
+  }
+  if(fcntl(fds[1], F_SETPIPE_SZ, PGSIZE) != -1){
+    printf("%s: shrank a full pipe\n", s);
+    exit(1);
+  }
+  for(n = 0; n < 4*PGSIZE; n += SZ){
+    if(read(fds[0], buf, SZ) != SZ){
+      printf("%s: read from grown pipe failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < SZ; i++){
+      if((buf[i] & 0xff) != ((n + i) & 0xff)){
+        printf("%s: wrong data\n", s);
+        exit(1);
+      }
+    }
+  }
+  if(fcntl(fds[1], F_SETPIPE_SZ, PGSIZE) != PGSIZE){
+    printf("%s: could not shrink empty pipe\n", s);
+    exit(1);
+  }
+
+  // 4000 bytes that wrap around the end of the one-page ring.
+  w = r = 0;
+  pswrite(s, fds[1], 3000, &w);
+  psread(s, fds[0], 1000, &r);
+  pswrite(s, fds[1], 2000, &w);
+  if(fcntl(fds[1], F_SETPIPE_SZ, 2*PGSIZE) != 2*PGSIZE){
+    printf("%s: could not grow a wrapped pipe\n", s);
+    exit(1);
+  }
+  pswrite(s, fds[1], 4000, &w);
+  psread(s, fds[0], 5000, &r);
+  // 3000 bytes that straddle the two pages.
+  if(fcntl(fds[1], F_SETPIPE_SZ, PGSIZE) != PGSIZE){
+    printf("%s: could not shrink a straddling pipe\n", s);
+    exit(1);
+  }
+  psread(s, fds[0], 3000, &r);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+
+// move a file through two pipes and into another file
+// with splice(), and check what arrives.
+void
+splicetest(char *s)
+{
+  int fd, a[2], b[2], i, n;
+  enum { SZ=3*PGSIZE+100 };
+
+  unlink("splicein");
+  unlink("spliceout");
+  fd = open("splicein", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: cannot create splicein\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++)
+    buf[i] = i % 251;
+  if(write(fd, buf, SZ) != SZ){
+    printf("%s: write splicein failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(pipe(a) != 0 || pipe(b) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  fcntl(a[0], F_SETPIPE_SZ, SZ);
+  fcntl(b[0], F_SETPIPE_SZ, SZ);
+  if((fd = open("splicein", O_RDONLY)) < 0){
+    printf("%s: cannot open splicein\n", s);
+    exit(1);
+  }
+  if((n = splice(fd, a[1], SZ)) != SZ){
+    printf("%s: splice file to pipe returned %d\n", s, n);
+    exit(1);
+  }
+  close(fd);
+  if((n = splice(a[0], b[1], SZ)) != SZ){
+    printf("%s: splice pipe to pipe returned %d\n", s, n);
+    exit(1);
+  }
+  if((fd = open("spliceout", O_CREATE|O_RDWR)) < 0){
+    printf("%s: cannot create spliceout\n", s);
+    exit(1);
+  }
+  if((n = splice(b[0], fd, SZ)) != SZ){
+    printf("%s: splice pipe to file returned %d\n", s, n);
+    exit(1);
+  }
+  close(fd);
+  if(splice(a[0], b[0], 1) != -1){
+    printf("%s: spliced to a read end\n", s);
+    exit(1);
+  }
+  close(a[0]);
+  close(a[1]);
+  close(b[0]);
+  close(b[1]);
+
+  memset(buf, 0, SZ);
+  fd = open("spliceout", O_RDONLY);
+  if(fd < 0 || read(fd, buf, SZ+1) != SZ){
+    printf("%s: spliceout has the wrong size\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < SZ; i++){
+    if((buf[i] & 0xff) != i % 251){
+      printf("%s: wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  unlink("splicein");
+  unlink("spliceout");
+}
+
+
+// poll() many pipes at once; only the one written to,
+// and the one whose write end closes, should be ready.
+void
+polltest(char *s)
+{
+  enum { NP=100, K=37, H=5 };
+  int fds[NP][2], i, n, pid, xstatus;
+  struct pollfd pfd[NP];
+  char c;
+
+  for(i = 0; i < NP; i++){
+    if(pipe(fds[i]) != 0){
+      printf("%s: pipe() failed\n", s);
+      exit(1);
+    }
+    pfd[i].fd = fds[i][0];
+    pfd[i].events = POLLIN;
+  }
+  if((n = poll(pfd, NP, 0)) != 0){
+    printf("%s: poll of empty pipes returned %d\n", s, n);
+    exit(1);
+  }
+  if((n = poll(pfd, NP, 2)) != 0){
+    printf("%s: timed poll of empty pipes returned %d\n", s, n);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    sleep(1);
+    if(write(fds[K][1], "x", 1) != 1)
+      exit(1);
+    exit(0);
+  }
+  if((n = poll(pfd, NP, -1)) != 1 || pfd[K].revents != POLLIN){
+    printf("%s: poll returned %d, revents %d\n", s, n, pfd[K].revents);
+    exit(1);
+  }
+  for(i = 0; i < NP; i++){
+    if(i != K && pfd[i].revents != 0){
+      printf("%s: pipe %d ready too\n", s, i);
+      exit(1);
+    }
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if(read(fds[K][0], &c, 1) != 1 || c != 'x'){
+    printf("%s: read after poll failed\n", s);
+    exit(1);
+  }
+
+  close(fds[H][1]);
+  if((n = poll(pfd, NP, -1)) != 1 || pfd[H].revents != POLLHUP){
+    printf("%s: poll after close returned %d, revents %d\n", s, n, pfd[H].revents);
+    exit(1);
+  }
+  for(i = 0; i < NP; i++){
+    close(fds[i][0]);
+    if(i != H)
+      close(fds[i][1]);
+  }
+}
+
+
+// reads and writes on O_NONBLOCK files return EWOULDBLOCK
+// rather than sleep.
+void
+nonblocktest(char *s)
+{
+  int fds[2], fd, n, r;
+  char c;
+
+  if(pipe2(fds, O_NONBLOCK) != 0){
+    printf("%s: pipe2() failed\n", s);
+    exit(1);
+  }
+  if((r = read(fds[0], &c, 1)) != EWOULDBLOCK){
+    printf("%s: read of empty pipe returned %d\n", s, r);
+    exit(1);
+  }
+  for(n = 0; (r = write(fds[1], buf, 1000)) > 0; n += r)
+    ;
+  if(r != EWOULDBLOCK || n != fcntl(fds[1], F_GETPIPE_SZ, 0)){
+    printf("%s: filled pipe with %d bytes, then got %d\n", s, n, r);
+    exit(1);
+  }
+  if(fcntl(fds[0], F_GETFL, 0) != O_NONBLOCK ||
+     fcntl(fds[0], F_SETFL, 0) != 0 || fcntl(fds[0], F_GETFL, 0) != 0){
+    printf("%s: F_GETFL/F_SETFL failed\n", s);
+    exit(1);
+  }
+  while(n > 0 && (r = read(fds[0], buf, 1000)) > 0)
+    n -= r;
+  if(n != 0){
+    printf("%s: could not drain pipe\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  fd = open(".", O_RDONLY|O_NONBLOCK);
+  if(fd < 0){
+    printf("%s: open(., O_NONBLOCK) failed\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
 
 // test if child is killed (status = -1)
 void
@@ -1864,6 +2163,49 @@ rmdot(char *s)
   }
 }
 
+// a removed directory's "." and ".." must not outlive it
+// in the directory entry cache, even when the next new
+// directory gets the same inode number.
+void
+rmdirreuse(char *s)
+{
+  struct stat st, root;
+
+  if(mkdir("rmd") != 0 || chdir("rmd") != 0){
+    printf("%s: mkdir/chdir rmd failed\n", s);
+    exit(1);
+  }
+  // cache rmd's "..".
+  if(chdir("..") != 0 || stat(".", &root) < 0){
+    printf("%s: chdir .. failed\n", s);
+    exit(1);
+  }
+  if(unlink("rmd") != 0){
+    printf("%s: unlink rmd failed\n", s);
+    exit(1);
+  }
+  if(mkdir("rme") != 0){
+    printf("%s: mkdir rme after rmdir failed\n", s);
+    exit(1);
+  }
+  if(mkdir("rme/sub") != 0){
+    printf("%s: mkdir rme/sub failed\n", s);
+    exit(1);
+  }
+  if(stat("rme/sub/../..", &st) < 0 || st.ino != root.ino){
+    printf("%s: rme/sub/../.. is not the parent\n", s);
+    exit(1);
+  }
+  if(stat("rme/..", &st) < 0 || st.ino != root.ino){
+    printf("%s: rme/.. is not the parent\n", s);
+    exit(1);
+  }
+  if(unlink("rme/sub") != 0 || unlink("rme") != 0){
+    printf("%s: unlink rme failed\n", s);
+    exit(1);
+  }
+}
+
 void
 dirfile(char *s)
 {
@@ -2609,6 +2951,10 @@ struct test {
   {dirtest, "dirtest"},
   {exectest, "exectest"},
   {pipe1, "pipe1"},
+  {pipesize, "pipesize"},
+  {splicetest, "splicetest"},
+  {polltest, "polltest"},
+  {nonblocktest, "nonblocktest"},
   {killstatus, "killstatus"},
   {preempt, "preempt"},
   {exitwait, "exitwait"},
@@ -2630,6 +2976,7 @@ struct test {
   {bigfile, "bigfile"},
   {fourteen, "fourteen"},
   {rmdot, "rmdot"},
+  {rmdirreuse, "rmdirreuse"},
   {dirfile, "dirfile"},
   {iref, "iref"},
   {forktest, "forktest"},
@@ -2699,6 +3046,61 @@ bigdir(char *s)
   }
 }
 
+// more names than two buckets of the hashed root directory hold
+// (see mkfs -h in the Makefile), all hashing to the same bucket,
+// so that some go in the overflow blocks.
+void
+hashspill(char *s)
+{
+  enum { N = 2*(DPB-1) + 8, NBUCKET = 64 };
+  static char names[N][DIRSIZ];
+  char name[DIRSIZ];
+  struct stat st;
+  int i, j, fd;
+
+  for(i = 0, j = 0; i < N; j++){
+    name[0] = 'h';
+    name[1] = 's';
+    name[2] = '0' + (j / 1000) % 10;
+    name[3] = '0' + (j / 100) % 10;
+    name[4] = '0' + (j / 10) % 10;
+    name[5] = '0' + j % 10;
+    name[6] = '\0';
+    if(dirhash(name) % NBUCKET == 7)
+      memmove(names[i++], name, DIRSIZ);
+  }
+
+  unlink("hs");
+  fd = open("hs", O_CREATE);
+  if(fd < 0){
+    printf("%s: hashspill create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < N; i++){
+    if(link("hs", names[i]) != 0){
+      printf("%s: hashspill link(hs, %s) failed\n", s, names[i]);
+      exit(1);
+    }
+  }
+  unlink("hs");
+
+  for(i = 0; i < N; i++){
+    if(stat(names[i], &st) < 0 || st.nlink != N - i){
+      printf("%s: hashspill stat %s failed\n", s, names[i]);
+      exit(1);
+    }
+    if(unlink(names[i]) != 0){
+      printf("%s: hashspill unlink %s failed\n", s, names[i]);
+      exit(1);
+    }
+    if(stat(names[i], &st) == 0){
+      printf("%s: hashspill %s still there\n", s, names[i]);
+      exit(1);
+    }
+  }
+}
+
 // concurrent writes to try to provoke deadlock in the virtio disk
 // driver.
 void
@@ -2941,6 +3343,7 @@ outofinodes(char *s)
 
 struct test slowtests[] = {
   {bigdir, "bigdir"},
+  {hashspill, "hashspill"},
   {manywrites, "manywrites"},
   {badwrite, "badwrite" },
   {execout, "execout"},
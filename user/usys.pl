@@ -37,4 +37,8 @@ entry("sbrk");
 entry("sleep");
 entry("uptime");
 entry("dump");
-entry("dump2");
\ No newline at end of file
+entry("dump2");
+entry("fcntl");
+entry("splice");
+entry("poll");
+entry("pipe2");